@@ -7,7 +7,14 @@
 #ifndef _avl_TREE_HPP_
 # define _avl_TREE_HPP_
 
+# include <algorithm>
+# include <cassert>
+# include <cstddef>
 # include <functional>
+# include <future>
+# include <iterator>
+# include <memory>
+# include <utility>
 
 # undef DS
 
@@ -20,18 +27,33 @@ namespace DS {
     int                  _balance;
   };
 
-  template <typename Data>
-  struct _avl_tree_node : public _avl_tree_node_base {
+  /**
+   * Node base of the trees keeping subtree sizes, see AVL::sized.
+   */
+  struct _avl_tree_sized_node_base : public _avl_tree_node_base {
+    std::size_t          _size; // nodes in the subtree
+  };
+
+  template <typename Data, typename Base = _avl_tree_node_base>
+  struct _avl_tree_node : public Base {
     Data                      _value;
   };
 
+  /**
+   * Balance factor marking the header, which no node can have: it tells
+   * the header from the root, both being the parent of the other.
+   */
+  static const int _avl_tree_header_balance = 3;
+
   /**
    * Bidirectional iterator compatible with the STL
    */
   static
   _avl_tree_node_base*
   _avl_tree_decrement(_avl_tree_node_base* x) {
-    if (x->_left != NULL) {
+    if (x->_balance == _avl_tree_header_balance) {
+      x = x->_right; // end() to the rightmost node
+    } else if (x->_left != NULL) {
       _avl_tree_node_base* y = x->_left;
       while (y->_right != NULL)
         y = y->_right;
@@ -78,7 +100,7 @@ namespace DS {
     return _avl_tree_increment(const_cast<_avl_tree_node_base*>(x));
   }
 
-  template <typename Data>
+  template <typename Data, typename Base = _avl_tree_node_base>
   struct _avl_tree_iterator {
     typedef Data  value_type;
     typedef Data& reference;
@@ -87,8 +109,8 @@ namespace DS {
     typedef std::bidirectional_iterator_tag iterator_category;
     typedef ptrdiff_t                       difference_type;
 
-    typedef _avl_tree_iterator<Data> Self;
-    typedef _avl_tree_node<Data>*    Link_type;
+    typedef _avl_tree_iterator<Data,Base> Self;
+    typedef _avl_tree_node<Data,Base>*    Link_type;
 
     _avl_tree_iterator()
     : _node() { }
@@ -141,6 +163,112 @@ namespace DS {
     _avl_tree_node_base* _node;
   };
 
+  template <typename Data, typename Base = _avl_tree_node_base>
+  struct _avl_tree_const_iterator {
+    typedef Data        value_type;
+    typedef const Data& reference;
+    typedef const Data* pointer;
+
+    typedef std::bidirectional_iterator_tag iterator_category;
+    typedef ptrdiff_t                       difference_type;
+
+    typedef _avl_tree_const_iterator<Data,Base> Self;
+    typedef const _avl_tree_node<Data,Base>*    Link_type;
+
+    _avl_tree_const_iterator()
+    : _node() { }
+
+    explicit _avl_tree_const_iterator(Link_type x)
+    : _node(x) {}
+
+    _avl_tree_const_iterator(const _avl_tree_iterator<Data,Base>& it)
+    : _node(it._node) {}
+
+    reference
+    operator*() const
+    { return static_cast<Link_type>(_node)->_value; }
+
+    pointer
+    operator->() const
+    { return &static_cast<Link_type>(_node)->_value; }
+
+    Self&
+    operator++() {
+      _node = _avl_tree_increment(_node);
+      return *this;
+    }
+
+    Self
+    operator++(int) {
+      Self tmp = *this;
+      _node = _avl_tree_increment(_node);
+      return tmp;
+    }
+
+    Self&
+    operator--() {
+      _node = _avl_tree_decrement(_node);
+      return *this;
+    }
+
+    Self
+    operator--(int) {
+      Self tmp = *this;
+      _node = _avl_tree_decrement(_node);
+      return tmp;
+    }
+
+    bool
+    operator==(const Self& x) const
+    { return _node == x._node; }
+
+    bool
+    operator!=(const Self& x) const
+    { return _node != x._node; }
+
+    const _avl_tree_node_base* _node;
+  };
+
+  template <typename Data, typename Base>
+  inline bool
+  operator==(const _avl_tree_iterator<Data,Base>& x,
+             const _avl_tree_const_iterator<Data,Base>& y)
+  { return x._node == y._node; }
+
+  template <typename Data, typename Base>
+  inline bool
+  operator!=(const _avl_tree_iterator<Data,Base>& x,
+             const _avl_tree_const_iterator<Data,Base>& y)
+  { return x._node != y._node; }
+
+
+  /**
+   * Memory used by a tree, in bytes.
+   * Allocator overhead is estimated for a malloc keeping a one word header
+   * and 16 bytes alignment per allocation.
+   */
+  struct tree_memory_usage {
+    std::size_t nodes;
+    std::size_t node_bytes;           // nodes, links and balance included
+    std::size_t payload_bytes;        // stored values, part of node_bytes
+    std::size_t augmentation_bytes;   // part of payload_bytes
+    std::size_t allocator_overhead;
+    std::size_t header_bytes;         // the _header sentinel node
+    std::size_t end_iterator_bytes;   // the end() iterator kept by the tree
+    std::size_t dummy_interval_bytes;
+    std::size_t fixed_bytes;          // the tree object, all the above included
+
+    std::size_t
+    total() const
+    { return node_bytes + allocator_overhead + fixed_bytes; }
+  };
+
+  inline
+  std::size_t
+  _allocator_overhead(std::size_t bytes) {
+    std::size_t chunk = (bytes + sizeof(std::size_t) + 15) & ~std::size_t(15);
+    return (chunk < 32 ? 32 : chunk) - bytes;
+  }
 
   /**
    * Self-balancing binary search tree
@@ -196,6 +324,8 @@ namespace DS {
       static
       void
       update(Node_ptr leaf, Node_ptr& unbalanced, Node_ptr& root) {
+        if (leaf == root) // the header keeps its own balance
+          return;
         // Update balances bottom-up.
         for (;;) {
           Node_ptr p = leaf->_parent;
@@ -203,11 +333,111 @@ namespace DS {
             p->_balance--;
           else
             p->_balance++;
-          if (p == unbalanced)
+          if (p == unbalanced || p == root)
             break;
           leaf = p;
         }
       }
+
+      /**
+       * Called once the subtree below x changed, from x up to root.
+       */
+      static
+      void
+      repair(Node_ptr, Node_ptr) {}
+    };
+
+    /**
+     * Subtree size policies. unsized keeps none, so that split counts the
+     * nodes of the smaller of its pieces. sized keeps in each node the
+     * size of its subtree, so that split is O(log n) whatever the pieces,
+     * for a word per node and a walk to the root on every insertion and
+     * erasure.
+     */
+    struct unsized {
+      typedef _avl_tree_node_base node_base;
+      static const bool counted = false;
+
+      static
+      std::size_t
+      size(const _avl_tree_node_base*)
+      { return 0; }
+
+      static
+      void
+      set(Node_ptr, std::size_t) {}
+
+      static
+      void
+      sum(Node_ptr) {}
+
+      static
+      void
+      add(Node_ptr, Node_ptr, std::size_t) {}
+
+      static
+      void
+      remove(Node_ptr, Node_ptr) {}
+
+      static
+      void
+      rotated(Node_ptr) {}
+    };
+
+    struct sized {
+      typedef _avl_tree_sized_node_base node_base;
+      static const bool counted = true;
+
+      static
+      std::size_t
+      size(const _avl_tree_node_base* x) {
+        return x == NULL ? 0
+          : static_cast<const _avl_tree_sized_node_base*>(x)->_size;
+      }
+
+      static
+      void
+      set(Node_ptr x, std::size_t n)
+      { static_cast<_avl_tree_sized_node_base*>(x)->_size = n; }
+
+      /**
+       * Set the size of x from its children.
+       */
+      static
+      void
+      sum(Node_ptr x)
+      { set(x, size(x->_left) + size(x->_right) + 1); }
+
+      /**
+       * Add n nodes to the subtrees from x up to, but not including, end.
+       */
+      static
+      void
+      add(Node_ptr x, Node_ptr end, std::size_t n) {
+        for (; x != end; x = x->_parent)
+          static_cast<_avl_tree_sized_node_base*>(x)->_size += n;
+      }
+
+      /**
+       * Take one node from the subtrees from x up to, but not including,
+       * end.
+       */
+      static
+      void
+      remove(Node_ptr x, Node_ptr end) {
+        for (; x != end; x = x->_parent)
+          static_cast<_avl_tree_sized_node_base*>(x)->_size--;
+      }
+
+      /**
+       * Fix the sizes after x was rotated down below its parent.
+       */
+      static
+      void
+      rotated(Node_ptr x) {
+        set(x->_parent, size(x));
+        sum(x);
+      }
     };
   }
 
@@ -216,7 +446,8 @@ namespace DS {
             typename Compare = std::less<Key>,
             typename Alloc = std::allocator<std::pair<const Key,Data> >,
             typename Rotation = AVL::rotation,
-            typename Updater = AVL::updater>
+            typename Updater = AVL::updater,
+            typename Sizes = AVL::unsized>
   class avl_tree {
   public:
     typedef Key                                 key_type;
@@ -229,23 +460,28 @@ namespace DS {
     typedef size_t                              size_type;
     typedef Alloc                               allocator_type;
 
-    typedef _avl_tree_iterator<value_type>      iterator;
-    typedef std::reverse_iterator<iterator>     reverse_iterator;
+    typedef _avl_tree_iterator<value_type,typename Sizes::node_base> iterator;
+    typedef _avl_tree_const_iterator<value_type,typename Sizes::node_base>
+                                                 const_iterator;
+    typedef std::reverse_iterator<iterator>      reverse_iterator;
+    typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
 
   protected:
     typedef _avl_tree_node_base*              Base_ptr;
     typedef const _avl_tree_node_base*        Const_Base_ptr;
-    typedef _avl_tree_node<value_type>*       Link_type;
-    typedef const _avl_tree_node<value_type>* Const_Link_type;
+    typedef _avl_tree_node<value_type,typename Sizes::node_base> Node;
+    typedef Node*                             Link_type;
+    typedef const Node*                       Const_Link_type;
 
   private:
-    typedef typename Alloc::template rebind<_avl_tree_node<value_type> >::other
-      _Node_allocator;
+    typedef typename std::allocator_traits<Alloc>::template
+      rebind_alloc<Node>                          _Node_allocator;
+    typedef std::allocator_traits<_Node_allocator> _Node_traits;
     _Node_allocator       _alloc;
 
   protected:
     Compare                    _compare;
-    _avl_tree_node<value_type> _header; // Holds root, leftmost and rightmost nodes.
+    Node                       _header; // Holds root, leftmost and rightmost nodes.
                                    // leftmost node of the tree, to enable constant time begin()
                                    // being parent of root enables representing end() iterator
                                    // having root for parent for finding root with a single indirection
@@ -253,15 +489,37 @@ namespace DS {
 
   public:
     // allocation/deallocation
-    avl_tree() {
+    avl_tree()
+    : _node_count(0) {
+      this->_header._left = &this->_header;
+      this->_header._right = &this->_header;
+      this->_header._parent = NULL;
+      this->_header._balance = _avl_tree_header_balance;
+      Sizes::set(&this->_header, 0);
+    }
+
+    explicit avl_tree(const Alloc& a)
+    : _alloc(a), _node_count(0) {
+      this->_header._left = &this->_header;
+      this->_header._right = &this->_header;
+      this->_header._parent = NULL;
+      this->_header._balance = _avl_tree_header_balance;
+      Sizes::set(&this->_header, 0);
+    }
+
+    avl_tree(const Compare& c, const Alloc& a)
+    : _alloc(a), _compare(c), _node_count(0) {
       this->_header._left = &this->_header;
       this->_header._right = &this->_header;
       this->_header._parent = NULL;
-      this->_header._balance = 0;
+      this->_header._balance = _avl_tree_header_balance;
+      Sizes::set(&this->_header, 0);
     }
 
-    avl_tree(const avl_tree<Key,Data,Compare,Alloc,Rotation,Updater>& o)
+    avl_tree(const avl_tree<Key,Data,Compare,Alloc,Rotation,Updater,Sizes>& o)
     : _alloc(o._alloc), _compare(o._compare), _header(o._header), _node_count(o._node_count) {
+      _header._left = &_header;
+      _header._right = &_header;
       if (o._header._parent != NULL) {
         _header._parent = _copy(o._begin(), _end());
         _header._parent->_parent = &_header;
@@ -283,7 +541,36 @@ namespace DS {
     iterator begin() {
       return iterator(_left(&_header)); // points to leftmost (not to confuse with _begin)
     }
+    const_iterator begin() const { return const_iterator(_left(&_header)); }
     iterator end() { return iterator(_end()); }
+    const_iterator end() const { return const_iterator(_end()); }
+
+    reverse_iterator rbegin() { return reverse_iterator(end()); }
+    const_reverse_iterator rbegin() const { return const_reverse_iterator(end()); }
+    reverse_iterator rend() { return reverse_iterator(begin()); }
+    const_reverse_iterator rend() const { return const_reverse_iterator(begin()); }
+
+    size_type size() const { return _node_count; }
+
+    bool empty() const { return _header._parent == NULL; }
+
+    allocator_type get_allocator() const { return allocator_type(_alloc); }
+
+    /**
+     * Bytes held by the tree, allocated nodes and the tree object itself.
+     */
+    tree_memory_usage
+    memory_usage() const {
+      tree_memory_usage m = tree_memory_usage();
+      m.nodes = size();
+      m.node_bytes = m.nodes * sizeof(Node);
+      m.payload_bytes = m.nodes * sizeof(value_type);
+      m.allocator_overhead =
+        m.nodes * _allocator_overhead(sizeof(Node));
+      m.header_bytes = sizeof(_header);
+      m.fixed_bytes = sizeof(*this);
+      return m;
+    }
 
   protected:
     Link_type _begin() { return _parent(&_header); } // points to root
@@ -307,32 +594,190 @@ namespace DS {
             j->first)) ? end() : j;
     }
 
-    std::pair<iterator,bool>
-    insert(const value_type& v) {
-      Link_type x = _begin();
-      Link_type y = _end();
-      Base_ptr unbalanced = y;
-      bool comp = true;
-      while (x != NULL) {
-        if (x->_balance != 0)
-          unbalanced = x;
-        y = x;
-        comp = _compare(v.first, x->_value.first);
-        x = comp ? _left(x) : _right(x);
+    /**
+     * First node whose key is not before k, or end().
+     */
+    iterator
+    lower_bound(const key_type& k)
+    { return iterator(const_cast<Link_type>(_lower_bound(k))); }
+
+    const_iterator
+    lower_bound(const key_type& k) const
+    { return const_iterator(_lower_bound(k)); }
+
+    /**
+     * First node whose key is after k, or end().
+     */
+    iterator
+    upper_bound(const key_type& k)
+    { return iterator(const_cast<Link_type>(_upper_bound(k))); }
+
+    const_iterator
+    upper_bound(const key_type& k) const
+    { return const_iterator(_upper_bound(k)); }
+
+    void
+    erase(iterator pos) {
+      _erase_node(static_cast<Link_type>(pos._node));
+    }
+
+    size_type
+    erase(const key_type& k) {
+      iterator i = find(k);
+      if (i == end())
+        return 0;
+      erase(i);
+      return 1;
+    }
+
+    /**
+     * Move the nodes whose keys are not before k to right, which must be
+     * empty, keeping the others. Nodes are relinked, not moved or
+     * allocated: O(log n) under AVL::sized, otherwise O(log n + m) for m
+     * the size of the smaller piece, which is counted.
+     */
+    void
+    split(const key_type& k,
+          avl_tree<Key,Data,Compare,Alloc,Rotation,Updater,Sizes>& right) {
+      assert(right.empty());
+      Base_ptr root = _header._parent;
+      if (root == NULL)
+        return;
+      root->_parent = NULL;
+      Base_ptr l, r;
+      int hl, hr;
+      _split(root, _height(root), k, l, hl, r, hr, NULL);
+      _set_root(l);
+      right._set_root(r);
+      const size_type n = _node_count;
+      if (Sizes::counted) {
+        _node_count = Sizes::size(l);
+      } else {
+        // Walk both pieces in order side by side until one runs out.
+        Base_ptr i = _header._left, j = right._header._left;
+        size_type m = 0;
+        for (; i != &_header && j != &right._header; ++m) {
+          i = _avl_tree_increment(i);
+          j = _avl_tree_increment(j);
+        }
+        _node_count = i == &_header ? m : n - m;
       }
-      iterator j = iterator(y);
-      if (comp) {
-        if (j == begin())
-          return std::make_pair(_insert(comp, y, v, unbalanced), true);
-        else
-          --j;
+      right._node_count = n - _node_count;
+    }
+
+    /**
+     * Move the nodes of right, whose keys must all come after the keys of
+     * this tree, to the end of this tree. O(log n): nodes are relinked,
+     * not moved or allocated.
+     */
+    void
+    join(avl_tree<Key,Data,Compare,Alloc,Rotation,Updater,Sizes>& right) {
+      if (right._header._parent == NULL)
+        return;
+      size_type n = _node_count + right._node_count;
+      if (_header._parent == NULL) {
+        _set_root(right._header._parent);
+      } else {
+        Base_ptr m = right._header._left;
+        right._unlink(m);
+        Base_ptr l = _header._parent, r = right._header._parent;
+        l->_parent = NULL;
+        if (r != NULL)
+          r->_parent = NULL;
+        int h;
+        _set_root(_join(l, _height(l), m, r, _height(r), h));
       }
-      if (_compare(j->first, v.first))
-        return std::make_pair(_insert(comp, y, v, unbalanced), true);
-      return std::make_pair(j, false);
+      _node_count = n;
+      right._set_root(NULL);
+      right._node_count = 0;
+    }
+
+    /**
+     * Move the nodes of other to this tree, destroying those whose key is
+     * already here; the allocators must compare equal. Divide and conquer
+     * on split and join, O(m log(n/m + 1)) for m the size of the smaller
+     * tree. Given more than one thread, the two halves of each level are
+     * merged on separate threads while they are large enough. Those only
+     * relink nodes, calling the Rotation and Updater policies at once but
+     * never the allocator: the dropped nodes are destroyed on the calling
+     * thread.
+     */
+    void
+    merge(avl_tree<Key,Data,Compare,Alloc,Rotation,Updater,Sizes>& other,
+          unsigned threads = 1) {
+      Base_ptr a = _header._parent, b = other._header._parent;
+      if (b == NULL || &other == this)
+        return;
+      size_type n = _node_count + other._node_count;
+      other._set_root(NULL);
+      other._node_count = 0;
+      b->_parent = NULL;
+      if (a != NULL)
+        a->_parent = NULL;
+      int h;
+      Base_ptr dropped = NULL;
+      _set_root(_union(a, _height(a), b, _height(b), h, dropped,
+                       threads == 0 ? 1 : threads));
+      _node_count = n - _destroy_list(dropped);
+    }
+
+    /**
+     * Insert the values of [first,last), sorted by key: they are linked
+     * into a balanced tree in O(m), then merged in. Values whose key is
+     * already present, or repeats the previous one, are dropped; a value
+     * out of order has the values before it merged in first, then is
+     * inserted alone, so that the first value given for a key is kept.
+     */
+    template <typename InputIterator>
+    void
+    insert_batch(InputIterator first, InputIterator last, unsigned threads = 1) {
+      _chain_type c(*this);
+      for (; first != last; ++first)
+        _chain(c, threads, (*first).first, *first);
+      _insert_batch(c, threads);
+    }
+
+    /**
+     * Erase the nodes whose keys are in [first,last), sorted. Divide and
+     * conquer on the tree, each subtree being given the part of the range
+     * that falls in it, O(m log(n/m + 1)), on up to threads threads as
+     * merge does. Returns the number of nodes erased.
+     */
+    template <typename RandomAccessIterator>
+    size_type
+    erase_batch(RandomAccessIterator first, RandomAccessIterator last,
+                unsigned threads = 1) {
+      return _erase_batch(first, last, threads, _any_match());
+    }
+
+    std::pair<iterator,bool>
+    insert(const value_type& v) {
+      return _emplace_unique(v.first, v);
+    }
+
+    std::pair<iterator,bool>
+    insert(value_type&& v) {
+      return _emplace_unique(v.first, std::move(v));
+    }
+
+    /**
+     * Insert v next to hint when its key belongs there, as std::map does,
+     * end() standing for after the rightmost node, without descending from
+     * the root. Falls back to insert(v) otherwise. Returns the node holding
+     * the key of v. Amortized O(1) plus the updater's work for appends,
+     * O(log n) under AVL::sized, which walks up to the root.
+     */
+    iterator
+    insert(iterator hint, const value_type& v) {
+      return _insert_hint(hint._node, v.first, v).first;
     }
 
   protected:
+    static
+    const value_type&
+    _value(Const_Base_ptr x)
+    { return static_cast<Const_Link_type>(x)->_value; }
+
     static Link_type
     _left(Base_ptr x)
     { return static_cast<Link_type>(x->_left); }
@@ -358,14 +803,371 @@ namespace DS {
     { return static_cast<Const_Link_type>(x->_parent); }
 
 
+    /**
+     * Unlink z, rebalance and free it. The other nodes are relinked, not
+     * moved, so pointers to them stay valid.
+     */
+    void
+    _erase_node(Link_type z) {
+      _unlink(z);
+      _destroy_node(z);
+      _node_count--;
+    }
+
+    /**
+     * Relink the nodes, chained in order through their right links, into
+     * a perfectly balanced tree of n nodes, replacing the current one.
+     * O(n), allocates nothing.
+     */
+    void
+    _rebuild(Link_type list, size_type n);
+
+    /**
+     * Nodes linked in key order through their right links, from list to
+     * tail, waiting to be built into a tree. Those still chained when it
+     * goes out of scope are destroyed, so that an exception thrown while
+     * chaining leaks nothing.
+     */
+    struct _chain_type {
+      avl_tree<Key,Data,Compare,Alloc,Rotation,Updater,Sizes>& tree;
+      Link_type list, tail;
+      size_type n;
+
+      explicit _chain_type(avl_tree<Key,Data,Compare,Alloc,Rotation,Updater,Sizes>& t)
+      : tree(t), list(NULL), tail(NULL), n(0) {}
+
+      ~_chain_type() {
+        while (list != NULL) {
+          Link_type next = _right(list);
+          tree._destroy_node(list);
+          list = next;
+        }
+      }
+    };
+
+    /**
+     * Append a node of key k, its value constructed from args, to the
+     * chain when k comes after the tail's key. Otherwise the value is
+     * dropped if k repeats the tail's key, or else the chain is merged in
+     * and the value inserted alone.
+     */
+    template <typename... Args>
+    void
+    _chain(_chain_type& c, unsigned threads, const key_type& k, Args&&... args) {
+      if (c.tail != NULL && !_compare(c.tail->_value.first, k)) {
+        if (_compare(k, c.tail->_value.first)) {
+          _insert_batch(c, threads);
+          _emplace_unique(k, std::forward<Args>(args)...);
+        }
+        return;
+      }
+      Link_type x = _create_node(std::forward<Args>(args)...);
+      x->_right = NULL;
+      if (c.tail == NULL)
+        c.list = x;
+      else
+        c.tail->_right = x;
+      c.tail = x;
+      c.n++;
+    }
+
+    /**
+     * Destroy the nodes whose keys are in [low,high), returning how many.
+     * O(log n + m) for the m nodes destroyed, whatever the size policy.
+     */
+    size_type
+    _erase_range(const key_type& low, const key_type& high) {
+      Base_ptr root = _header._parent;
+      if (root == NULL)
+        return 0;
+      root->_parent = NULL;
+      Base_ptr l, rest, m, r;
+      int hl, h_rest, hm, hr, h;
+      _split(root, _height(root), low, l, hl, rest, h_rest, NULL);
+      _split(rest, h_rest, high, m, hm, r, hr, NULL);
+      _set_root(_join(l, hl, r, hr, h));
+      size_type erased = _erase(static_cast<Link_type>(m));
+      _node_count -= erased;
+      return erased;
+    }
+
+    /**
+     * Build the nodes of c into a tree and merge it in, emptying c.
+     */
+    void
+    _insert_batch(_chain_type& c, unsigned threads) {
+      if (c.n == 0)
+        return;
+      avl_tree<Key,Data,Compare,Alloc,Rotation,Updater,Sizes> batch(get_allocator());
+      batch._compare = _compare;
+      batch._rebuild(c.list, c.n);
+      c.list = c.tail = NULL;
+      c.n = 0;
+      merge(batch, threads);
+    }
+
+    /**
+     * Erase the nodes whose keys are in the sorted range [first,last) and
+     * for which match(value, key) holds.
+     */
+    template <typename RandomAccessIterator, typename Match>
+    size_type
+    _erase_batch(RandomAccessIterator first, RandomAccessIterator last,
+                 unsigned threads, const Match& match) {
+      Base_ptr root = _header._parent;
+      if (root == NULL || first == last)
+        return 0;
+      root->_parent = NULL;
+      int h;
+      Base_ptr erased_list = NULL;
+      _set_root(_difference(root, _height(root), first, last, h, erased_list,
+                            threads == 0 ? 1 : threads, match));
+      size_type erased = _destroy_list(erased_list);
+      _node_count -= erased;
+      return erased;
+    }
+
+    template <typename... Args>
+    Link_type
+    _create_node(Args&&... args) {
+      Link_type x = _Node_traits::allocate(_alloc, 1);
+      try {
+        _Node_traits::construct(_alloc, &x->_value, std::forward<Args>(args)...);
+      } catch (...) {
+        _Node_traits::deallocate(_alloc, x, 1);
+        throw;
+      }
+      return x;
+    }
+
+    /**
+     * Put the detached node y in the place of x, which is destroyed.
+     */
+    void
+    _replace_node(Link_type x, Link_type y) {
+      y->_parent = x->_parent;
+      y->_left = x->_left;
+      y->_right = x->_right;
+      y->_balance = x->_balance;
+      Sizes::set(y, Sizes::size(x));
+      if (y->_left != NULL)
+        y->_left->_parent = y;
+      if (y->_right != NULL)
+        y->_right->_parent = y;
+      if (x->_parent == &_header)
+        _header._parent = y;
+      else if (x->_parent->_left == x)
+        x->_parent->_left = y;
+      else
+        x->_parent->_right = y;
+      if (_header._left == x)
+        _header._left = y;
+      if (_header._right == x)
+        _header._right = y;
+      _destroy_node(x);
+    }
+
+    void
+    _destroy_node(Link_type x) {
+      _Node_traits::destroy(_alloc, &x->_value);
+      _Node_traits::deallocate(_alloc, x, 1);
+    }
+
   private:
+    /**
+     * Rotations of the Rotation policy, keeping the subtree sizes.
+     */
+    static
+    void
+    _rotate_left(Base_ptr x, Base_ptr& root) {
+      Rotation::left(x, root);
+      Sizes::rotated(x);
+    }
+
+    static
+    void
+    _rotate_right(Base_ptr x, Base_ptr& root) {
+      Rotation::right(x, root);
+      Sizes::rotated(x);
+    }
+
     void
     _rebalance(Base_ptr&);
 
-    iterator
-    _insert(bool insert_left, Link_type&, const value_type&, Base_ptr&);
+    void
+    _unlink(Base_ptr z);
+
+    void
+    _rebalance_erase(Base_ptr p, bool left);
+
+    bool
+    _rebalance_grow(Base_ptr p, bool left, Base_ptr& root);
+
+    Base_ptr
+    _rotate_heavy(Base_ptr p, Base_ptr& root, bool& level);
+
+    Link_type
+    _hint_slot(Base_ptr hint, const key_type& k, bool& left);
+
+    Const_Link_type
+    _lower_bound(const key_type& k) const {
+      Const_Link_type x = _begin(), y = _end();
+      while (x != NULL)
+        if (!_compare(x->_value.first, k))
+          y = x, x = _left(x);
+        else
+          x = _right(x);
+      return y;
+    }
+
+    Const_Link_type
+    _upper_bound(const key_type& k) const {
+      Const_Link_type x = _begin(), y = _end();
+      while (x != NULL)
+        if (_compare(k, x->_value.first))
+          y = x, x = _left(x);
+        else
+          x = _right(x);
+      return y;
+    }
+
+  protected:
+    /**
+     * Descend to the place of key k and, when k is not there yet, create a
+     * node constructing its value from args. The value is built once, in
+     * the node.
+     */
+    template <typename... Args>
+    std::pair<iterator,bool>
+    _emplace_unique(const key_type& k, Args&&... args) {
+      Link_type x = _begin();
+      Link_type y = _end();
+      Base_ptr unbalanced = y;
+      bool comp = true;
+      while (x != NULL) {
+        if (x->_balance != 0)
+          unbalanced = x;
+        y = x;
+        comp = _compare(k, x->_value.first);
+        x = comp ? _left(x) : _right(x);
+      }
+      iterator j = iterator(y);
+      if (comp) {
+        if (j == begin())
+          return std::make_pair(_insert(comp, y, _create_node(std::forward<Args>(args)...),
+                                        unbalanced), true);
+        else
+          --j;
+      }
+      if (_compare(j->first, k))
+        return std::make_pair(_insert(comp, y, _create_node(std::forward<Args>(args)...),
+                                      unbalanced), true);
+      return std::make_pair(j, false);
+    }
+
+    /**
+     * Same as _emplace_unique, starting from hint rather than from the
+     * root when k belongs next to it.
+     */
+    template <typename... Args>
+    std::pair<iterator,bool>
+    _insert_hint(Base_ptr hint, const key_type& k, Args&&... args) {
+      if (hint != _end() && !_compare(k, _value(hint).first)
+          && !_compare(_value(hint).first, k))
+        return std::make_pair(iterator(static_cast<Link_type>(hint)), false);
+      bool left;
+      Link_type p = _hint_slot(hint, k, left);
+      if (p == NULL)
+        return _emplace_unique(k, std::forward<Args>(args)...);
+      Base_ptr unbalanced = p;
+      while (unbalanced != _end() && unbalanced->_balance == 0)
+        unbalanced = unbalanced->_parent;
+      return std::make_pair(_insert(left, p, _create_node(std::forward<Args>(args)...),
+                                    unbalanced), true);
+    }
+
+  private:
+
+
+    static
+    int
+    _height(Const_Base_ptr x) {
+      int h = 0;
+      for (; x != NULL; x = x->_balance < 0 ? x->_left : x->_right)
+        h++;
+      return h;
+    }
+
+    Base_ptr
+    _join(Base_ptr l, int hl, Base_ptr m, Base_ptr r, int hr, int& h);
+
+    void
+    _split(Base_ptr x, int h, const key_type& k,
+           Base_ptr& l, int& hl, Base_ptr& r, int& hr, Base_ptr* equal);
+
+    Base_ptr
+    _union(Base_ptr a, int ha, Base_ptr b, int hb, int& h,
+           Base_ptr& dropped, unsigned threads);
 
     void
+    _split_last(Base_ptr x, int h, Base_ptr& l, int& hl, Base_ptr& last);
+
+    Base_ptr
+    _join(Base_ptr l, int hl, Base_ptr r, int hr, int& h);
+
+    template <typename RandomAccessIterator, typename Match>
+    Base_ptr
+    _difference(Base_ptr x, int hx,
+                RandomAccessIterator first, RandomAccessIterator last,
+                int& h, Base_ptr& erased, unsigned threads, const Match& match);
+
+    /**
+     * Append the list rest to the nodes chained through their right links
+     * from list, returning the head.
+     */
+    static
+    Base_ptr
+    _append(Base_ptr list, Base_ptr rest) {
+      if (list == NULL)
+        return rest;
+      Base_ptr tail = list;
+      while (tail->_right != NULL)
+        tail = tail->_right;
+      tail->_right = rest;
+      return list;
+    }
+
+    /**
+     * Destroy the nodes chained through their right links from list,
+     * returning how many.
+     */
+    size_type
+    _destroy_list(Base_ptr list) {
+      size_type n = 0;
+      while (list != NULL) {
+        Link_type x = static_cast<Link_type>(list);
+        list = list->_right;
+        _destroy_node(x);
+        n++;
+      }
+      return n;
+    }
+
+    struct _any_match {
+      template <typename Key_>
+      bool operator()(const value_type&, const Key_&) const { return true; }
+    };
+
+    void
+    _set_root(Base_ptr root);
+
+    Link_type
+    _build(Link_type& list, size_type n, Base_ptr parent);
+
+    iterator
+    _insert(bool insert_left, Link_type p, Link_type leaf, Base_ptr unbalanced);
+
+    size_type
     _erase(Link_type);
 
     Link_type
@@ -373,9 +1175,9 @@ namespace DS {
 
     Link_type
     _clone_node(Const_Link_type x) {
-      Link_type tmp = _alloc.allocate(1);
-      Alloc(_alloc).construct(&tmp->_value, x->_value);
+      Link_type tmp = _create_node(x->_value);
       tmp->_balance = x->_balance;
+      Sizes::set(tmp, Sizes::size(x));
       tmp->_left = NULL;
       tmp->_right = NULL;
       return tmp;
@@ -383,18 +1185,17 @@ namespace DS {
   };
 
   template <typename Key, typename Data, typename Compare, typename Alloc,
-            typename Rotation, typename Updater>
-  typename avl_tree<Key,Data,Compare,Alloc,Rotation,Updater>::iterator
-  avl_tree<Key,Data,Compare,Alloc,Rotation,Updater>::_insert(bool insert_left,
-      Link_type& p,
-      const value_type& v,
-      Base_ptr& unbalanced) {
-    Link_type leaf = _alloc.allocate(1);
-    Alloc(_alloc).construct(&leaf->_value, v);
+            typename Rotation, typename Updater, typename Sizes>
+  typename avl_tree<Key,Data,Compare,Alloc,Rotation,Updater,Sizes>::iterator
+  avl_tree<Key,Data,Compare,Alloc,Rotation,Updater,Sizes>::_insert(bool insert_left,
+      Link_type p,
+      Link_type leaf,
+      Base_ptr unbalanced) {
     leaf->_parent = p;
     leaf->_left = NULL;
     leaf->_right = NULL;
     leaf->_balance = 0;
+    Sizes::set(leaf, 1);
 
     // Insert.
     // Make new node child of parent and maintain root, leftmost and
@@ -414,6 +1215,8 @@ namespace DS {
         _header._right = leaf; // maintain rightmost pointing to max node
     }
 
+    Sizes::add(p, &_header, 1);
+
     // Update balances bottom-up.
     Updater::update(leaf, unbalanced, _header._parent);
 
@@ -426,9 +1229,9 @@ namespace DS {
   }
 
   template <typename Key, typename Data, typename Compare, typename Alloc,
-            typename Rotation, typename Updater>
+            typename Rotation, typename Updater, typename Sizes>
   void
-  avl_tree<Key,Data,Compare,Alloc,Rotation,Updater>::_rebalance(Base_ptr& unbalanced)
+  avl_tree<Key,Data,Compare,Alloc,Rotation,Updater,Sizes>::_rebalance(Base_ptr& unbalanced)
   {
     Base_ptr& root = _header._parent;
 
@@ -461,9 +1264,9 @@ namespace DS {
           }
           right->_left->_balance = 0;
 
-          Rotation::right(right, root);
+          _rotate_right(right, root);
         }
-        Rotation::left(unbalanced, root);
+        _rotate_left(unbalanced, root);
         break;
       }
       case -2: {
@@ -489,32 +1292,549 @@ namespace DS {
           }
           left->_right->_balance = 0;
 
-          Rotation::left(left, root);
+          _rotate_left(left, root);
         }
-        Rotation::right(unbalanced, root);
+        _rotate_right(unbalanced, root);
         break;
       }
     }
   }
 
   template <typename Key, typename Data, typename Compare, typename Alloc,
-            typename Rotation, typename Updater>
+            typename Rotation, typename Updater, typename Sizes>
+  void
+  avl_tree<Key,Data,Compare,Alloc,Rotation,Updater,Sizes>::_unlink(Base_ptr z) {
+    Base_ptr& root = _header._parent;
+    Base_ptr p;     // parent of the position that lost a node
+    bool left;      // whether that position is the left child of p
+
+    if (z->_left != NULL && z->_right != NULL) {
+      // Move the successor y in place of z, its right child in place of y.
+      Base_ptr y = z->_right;
+      while (y->_left != NULL)
+        y = y->_left;
+      if (y->_parent == z) {
+        p = y;
+        left = false;
+      } else {
+        p = y->_parent;
+        left = true;
+        p->_left = y->_right;
+        if (y->_right != NULL)
+          y->_right->_parent = p;
+        y->_right = z->_right;
+        z->_right->_parent = y;
+      }
+      y->_left = z->_left;
+      z->_left->_parent = y;
+      y->_parent = z->_parent;
+      y->_balance = z->_balance;
+      Sizes::set(y, Sizes::size(z));
+      if (z == root)
+        root = y;
+      else if (z->_parent->_left == z)
+        z->_parent->_left = y;
+      else
+        z->_parent->_right = y;
+    } else {
+      Base_ptr c = z->_left != NULL ? z->_left : z->_right;
+      p = z->_parent;
+      if (c != NULL)
+        c->_parent = p;
+      if (z == root) {
+        root = c;
+        left = true;
+      } else if (p->_left == z) {
+        p->_left = c;
+        left = true;
+      } else {
+        p->_right = c;
+        left = false;
+      }
+      // maintain leftmost and rightmost, z has at most one child
+      if (_header._left == z) {
+        Base_ptr m = c != NULL ? c : p;
+        while (c != NULL && m->_left != NULL)
+          m = m->_left;
+        _header._left = m;
+      }
+      if (_header._right == z) {
+        Base_ptr m = c != NULL ? c : p;
+        while (c != NULL && m->_right != NULL)
+          m = m->_right;
+        _header._right = m;
+      }
+    }
+
+    if (p == &_header)
+      return;
+    Sizes::remove(p, &_header);
+    Updater::repair(p, root);
+    _rebalance_erase(p, left);
+  }
+
+  template <typename Key, typename Data, typename Compare, typename Alloc,
+            typename Rotation, typename Updater, typename Sizes>
+  typename avl_tree<Key,Data,Compare,Alloc,Rotation,Updater,Sizes>::Link_type
+  avl_tree<Key,Data,Compare,Alloc,Rotation,Updater,Sizes>::_hint_slot(Base_ptr hint,
+                                                                const key_type& k,
+                                                                bool& left) {
+    // The leaf to hang a node of key k from, when k falls between hint and
+    // one of its neighbours: one of the two has a free child on that side.
+    // NULL when the tree is empty or k does not fall next to hint.
+    if (_header._parent == NULL)
+      return NULL;
+    if (hint == _end()) {
+      left = false;
+      return _compare(_value(_header._right).first, k)
+        ? static_cast<Link_type>(_header._right) : NULL;
+    }
+    if (_compare(k, _value(hint).first)) {
+      if (hint == _header._left) {
+        left = true;
+        return static_cast<Link_type>(hint);
+      }
+      Base_ptr before = _avl_tree_decrement(hint);
+      if (!_compare(_value(before).first, k))
+        return NULL;
+      left = hint->_left == NULL;
+      return static_cast<Link_type>(left ? hint : before);
+    }
+    if (hint == _header._right) {
+      left = false;
+      return static_cast<Link_type>(hint);
+    }
+    Base_ptr after = _avl_tree_increment(hint);
+    if (!_compare(k, _value(after).first))
+      return NULL;
+    left = hint->_right != NULL;
+    return static_cast<Link_type>(left ? after : hint);
+  }
+
+  template <typename Key, typename Data, typename Compare, typename Alloc,
+            typename Rotation, typename Updater, typename Sizes>
+  typename avl_tree<Key,Data,Compare,Alloc,Rotation,Updater,Sizes>::Base_ptr
+  avl_tree<Key,Data,Compare,Alloc,Rotation,Updater,Sizes>::_rotate_heavy(Base_ptr p,
+                                                                   Base_ptr& root,
+                                                                   bool& level) {
+    // Rotate p, of balance 2 or -2, returning the new root of its subtree.
+    // level tells whether its heavy child was balanced, in which case the
+    // rotation does not change the height of the subtree.
+    if (p->_balance == 2) {
+      Base_ptr right = p->_right;
+      level = right->_balance == 0;
+      if (right->_balance == -1) {
+        Base_ptr middle = right->_left;
+        p->_balance = middle->_balance == 1 ? -1 : 0;
+        right->_balance = middle->_balance == -1 ? 1 : 0;
+        middle->_balance = 0;
+        _rotate_right(right, root);
+        _rotate_left(p, root);
+        return middle;
+      }
+      _rotate_left(p, root);
+      p->_balance = level ? 1 : 0;
+      right->_balance = level ? -1 : 0;
+      return right;
+    } else {
+      Base_ptr left = p->_left;
+      level = left->_balance == 0;
+      if (left->_balance == 1) {
+        Base_ptr middle = left->_right;
+        p->_balance = middle->_balance == -1 ? 1 : 0;
+        left->_balance = middle->_balance == 1 ? -1 : 0;
+        middle->_balance = 0;
+        _rotate_left(left, root);
+        _rotate_right(p, root);
+        return middle;
+      }
+      _rotate_right(p, root);
+      p->_balance = level ? -1 : 0;
+      left->_balance = level ? 1 : 0;
+      return left;
+    }
+  }
+
+  template <typename Key, typename Data, typename Compare, typename Alloc,
+            typename Rotation, typename Updater, typename Sizes>
+  void
+  avl_tree<Key,Data,Compare,Alloc,Rotation,Updater,Sizes>::_rebalance_erase(Base_ptr p,
+                                                                      bool left) {
+    Base_ptr& root = _header._parent;
+
+    // Walk up while the subtree that lost a node got shorter.
+    for (;;) {
+      p->_balance += left ? 1 : -1;
+      if (p->_balance == 1 || p->_balance == -1)
+        return;
+      Base_ptr top = p;
+      if (p->_balance != 0) {
+        bool level;
+        top = _rotate_heavy(p, root, level);
+        if (level)
+          return;
+      }
+      if (top == root)
+        return;
+      left = top->_parent->_left == top;
+      p = top->_parent;
+    }
+  }
+
+  template <typename Key, typename Data, typename Compare, typename Alloc,
+            typename Rotation, typename Updater, typename Sizes>
+  bool
+  avl_tree<Key,Data,Compare,Alloc,Rotation,Updater,Sizes>::_rebalance_grow(Base_ptr p,
+                                                                     bool left,
+                                                                     Base_ptr& root) {
+    // Walk up while the subtree that got a taller child grows, returning
+    // whether the whole tree did.
+    for (;;) {
+      p->_balance += left ? -1 : 1;
+      if (p->_balance == 0)
+        return false;
+      Base_ptr top = p;
+      if (p->_balance != 1 && p->_balance != -1) {
+        bool level;
+        top = _rotate_heavy(p, root, level);
+        if (!level)
+          return false;
+      }
+      if (top == root)
+        return true;
+      left = top->_parent->_left == top;
+      p = top->_parent;
+    }
+  }
+
+  template <typename Key, typename Data, typename Compare, typename Alloc,
+            typename Rotation, typename Updater, typename Sizes>
+  typename avl_tree<Key,Data,Compare,Alloc,Rotation,Updater,Sizes>::Base_ptr
+  avl_tree<Key,Data,Compare,Alloc,Rotation,Updater,Sizes>::_join(Base_ptr l, int hl,
+                                                           Base_ptr m,
+                                                           Base_ptr r, int hr,
+                                                           int& h) {
+    // Join the detached subtrees l and r of heights hl and hr through m,
+    // whose key lies between theirs. The shorter one hangs with m from
+    // the spine of the taller one, at the first node not more than one
+    // level taller than it, then the spine is repaired and rebalanced.
+    if (hl > hr + 1 || hr > hl + 1) {
+      const bool right_spine = hl > hr;
+      Base_ptr root = right_spine ? l : r;
+      Base_ptr p = NULL, c = root;
+      int hc = right_spine ? hl : hr;
+      const int hs = right_spine ? hr : hl;
+      const std::size_t added = Sizes::size(right_spine ? r : l) + 1;
+      while (hc > hs + 1) {
+        p = c;
+        if (right_spine) {
+          hc -= c->_balance < 0 ? 2 : 1;
+          c = c->_right;
+        } else {
+          hc -= c->_balance > 0 ? 2 : 1;
+          c = c->_left;
+        }
+      }
+      Sizes::add(p, NULL, added);
+      m->_left = right_spine ? c : l;
+      m->_right = right_spine ? r : c;
+      m->_balance = right_spine ? hr - hc : hc - hl;
+      Sizes::sum(m);
+      if (m->_left != NULL)
+        m->_left->_parent = m;
+      if (m->_right != NULL)
+        m->_right->_parent = m;
+      m->_parent = p;
+      if (right_spine)
+        p->_right = m;
+      else
+        p->_left = m;
+      Updater::repair(m, root);
+      h = (right_spine ? hl : hr) + (_rebalance_grow(p, !right_spine, root) ? 1 : 0);
+      return root;
+    }
+    m->_left = l;
+    m->_right = r;
+    m->_parent = NULL;
+    m->_balance = hr - hl;
+    Sizes::sum(m);
+    if (l != NULL)
+      l->_parent = m;
+    if (r != NULL)
+      r->_parent = m;
+    Updater::repair(m, m);
+    h = (hl > hr ? hl : hr) + 1;
+    return m;
+  }
+
+  template <typename Key, typename Data, typename Compare, typename Alloc,
+            typename Rotation, typename Updater, typename Sizes>
+  void
+  avl_tree<Key,Data,Compare,Alloc,Rotation,Updater,Sizes>::_split(Base_ptr x, int h,
+                                                            const key_type& k,
+                                                            Base_ptr& l, int& hl,
+                                                            Base_ptr& r, int& hr,
+                                                            Base_ptr* equal) {
+    // Split the detached subtree x of height h into the nodes before k and
+    // the others, joining back the pieces met on the way down. Given equal,
+    // the node of key k, if any, is detached and left out into it.
+    if (x == NULL) {
+      l = r = NULL;
+      hl = hr = 0;
+      return;
+    }
+    Base_ptr left = x->_left, right = x->_right;
+    int h_left = x->_balance > 0 ? h - 2 : h - 1;
+    int h_right = x->_balance < 0 ? h - 2 : h - 1;
+    if (left != NULL)
+      left->_parent = NULL;
+    if (right != NULL)
+      right->_parent = NULL;
+    const key_type& key = static_cast<Link_type>(x)->_value.first;
+    if (_compare(key, k)) {
+      Base_ptr rest;
+      int h_rest;
+      _split(right, h_right, k, rest, h_rest, r, hr, equal);
+      l = _join(left, h_left, x, rest, h_rest, hl);
+    } else if (equal != NULL && !_compare(k, key)) {
+      *equal = x;
+      l = left;
+      hl = h_left;
+      r = right;
+      hr = h_right;
+    } else {
+      Base_ptr rest;
+      int h_rest;
+      _split(left, h_left, k, l, hl, rest, h_rest, equal);
+      r = _join(rest, h_rest, x, right, h_right, hr);
+    }
+  }
+
+  template <typename Key, typename Data, typename Compare, typename Alloc,
+            typename Rotation, typename Updater, typename Sizes>
+  typename avl_tree<Key,Data,Compare,Alloc,Rotation,Updater,Sizes>::Base_ptr
+  avl_tree<Key,Data,Compare,Alloc,Rotation,Updater,Sizes>::_union(Base_ptr a, int ha,
+                                                            Base_ptr b, int hb,
+                                                            int& h,
+                                                            Base_ptr& dropped,
+                                                            unsigned threads) {
+    // Split the detached subtree b at the root of a, merge the halves with
+    // the subtrees of a and join them back through that root. The subtrees
+    // are disjoint, so the two merges can run on separate threads. Nodes of
+    // b whose key is in a are chained onto dropped.
+    if (a == NULL || b == NULL) {
+      h = a == NULL ? hb : ha;
+      return a == NULL ? b : a;
+    }
+    Base_ptr left = a->_left, right = a->_right;
+    int h_left = a->_balance > 0 ? ha - 2 : ha - 1;
+    int h_right = a->_balance < 0 ? ha - 2 : ha - 1;
+    if (left != NULL)
+      left->_parent = NULL;
+    if (right != NULL)
+      right->_parent = NULL;
+    Base_ptr l, r, equal = NULL;
+    int hl, hr;
+    _split(b, hb, static_cast<Link_type>(a)->_value.first, l, hl, r, hr, &equal);
+    if (equal != NULL) {
+      equal->_right = dropped;
+      dropped = equal;
+    }
+
+    int h_low, h_high;
+    Base_ptr low, high;
+    if (threads > 1 && h_left >= 12 && hl >= 12) {
+      // The future waits for the worker on its way out, should the merge
+      // here throw.
+      Base_ptr dropped_low = NULL;
+      std::future<Base_ptr> worker = std::async(std::launch::async, [&]() {
+        return _union(left, h_left, l, hl, h_low, dropped_low, threads / 2);
+      });
+      high = _union(right, h_right, r, hr, h_high, dropped,
+                    threads - threads / 2);
+      low = worker.get();
+      dropped = _append(dropped_low, dropped);
+    } else {
+      low = _union(left, h_left, l, hl, h_low, dropped, 1);
+      high = _union(right, h_right, r, hr, h_high, dropped, 1);
+    }
+    return _join(low, h_low, a, high, h_high, h);
+  }
+
+  template <typename Key, typename Data, typename Compare, typename Alloc,
+            typename Rotation, typename Updater, typename Sizes>
+  void
+  avl_tree<Key,Data,Compare,Alloc,Rotation,Updater,Sizes>::_split_last(Base_ptr x, int h,
+                                                                 Base_ptr& l, int& hl,
+                                                                 Base_ptr& last) {
+    // Detach the last node of the detached subtree x of height h, leaving
+    // the others in l.
+    Base_ptr left = x->_left, right = x->_right;
+    int h_left = x->_balance > 0 ? h - 2 : h - 1;
+    int h_right = x->_balance < 0 ? h - 2 : h - 1;
+    if (left != NULL)
+      left->_parent = NULL;
+    if (right == NULL) {
+      last = x;
+      l = left;
+      hl = h_left;
+      return;
+    }
+    right->_parent = NULL;
+    Base_ptr rest;
+    int h_rest;
+    _split_last(right, h_right, rest, h_rest, last);
+    l = _join(left, h_left, x, rest, h_rest, hl);
+  }
+
+  template <typename Key, typename Data, typename Compare, typename Alloc,
+            typename Rotation, typename Updater, typename Sizes>
+  typename avl_tree<Key,Data,Compare,Alloc,Rotation,Updater,Sizes>::Base_ptr
+  avl_tree<Key,Data,Compare,Alloc,Rotation,Updater,Sizes>::_join(Base_ptr l, int hl,
+                                                           Base_ptr r, int hr,
+                                                           int& h) {
+    // Join the detached subtrees l and r, the last node of l joining them.
+    if (l == NULL || r == NULL) {
+      h = l == NULL ? hr : hl;
+      return l == NULL ? r : l;
+    }
+    Base_ptr rest, m;
+    int h_rest;
+    _split_last(l, hl, rest, h_rest, m);
+    return _join(rest, h_rest, m, r, hr, h);
+  }
+
+  template <typename Key, typename Data, typename Compare, typename Alloc,
+            typename Rotation, typename Updater, typename Sizes>
+  template <typename RandomAccessIterator, typename Match>
+  typename avl_tree<Key,Data,Compare,Alloc,Rotation,Updater,Sizes>::Base_ptr
+  avl_tree<Key,Data,Compare,Alloc,Rotation,Updater,Sizes>::_difference(Base_ptr x, int hx,
+                                                                 RandomAccessIterator first,
+                                                                 RandomAccessIterator last,
+                                                                 int& h,
+                                                                 Base_ptr& erased,
+                                                                 unsigned threads,
+                                                                 const Match& match) {
+    // Give the keys before the root of the detached subtree x to its left
+    // subtree and the keys after to its right one, then join the results
+    // back, through the root unless it matched a key, in which case it is
+    // chained onto erased.
+    if (x == NULL || first == last) {
+      h = x == NULL ? 0 : hx;
+      return x;
+    }
+    const value_type& v = static_cast<Link_type>(x)->_value;
+    RandomAccessIterator middle = std::lower_bound(first, last, v.first, _compare);
+    RandomAccessIterator after = middle;
+    bool hit = false;
+    for (; after != last && !_compare(v.first, *after); ++after)
+      hit = hit || match(v, *after);
+    Base_ptr left = x->_left, right = x->_right;
+    int h_left = x->_balance > 0 ? hx - 2 : hx - 1;
+    int h_right = x->_balance < 0 ? hx - 2 : hx - 1;
+    if (left != NULL)
+      left->_parent = NULL;
+    if (right != NULL)
+      right->_parent = NULL;
+
+    int hl, hr;
+    Base_ptr l, r;
+    if (threads > 1 && h_left >= 12 && first != middle && after != last) {
+      Base_ptr erased_low = NULL;
+      std::future<Base_ptr> worker = std::async(std::launch::async, [&]() {
+        return _difference(left, h_left, first, middle, hl, erased_low,
+                           threads / 2, match);
+      });
+      r = _difference(right, h_right, after, last, hr, erased,
+                      threads - threads / 2, match);
+      l = worker.get();
+      erased = _append(erased_low, erased);
+    } else {
+      l = _difference(left, h_left, first, middle, hl, erased, 1, match);
+      r = _difference(right, h_right, after, last, hr, erased, 1, match);
+    }
+    if (!hit)
+      return _join(l, hl, x, r, hr, h);
+    x->_right = erased;
+    erased = x;
+    return _join(l, hl, r, hr, h);
+  }
+
+  template <typename Key, typename Data, typename Compare, typename Alloc,
+            typename Rotation, typename Updater, typename Sizes>
   void
-  avl_tree<Key,Data,Compare,Alloc,Rotation,Updater>::_erase(Link_type x) {
-    // Erase without rebalancing.
+  avl_tree<Key,Data,Compare,Alloc,Rotation,Updater,Sizes>::_set_root(Base_ptr root) {
+    _header._parent = root;
+    if (root == NULL) {
+      _header._left = &_header;
+      _header._right = &_header;
+      return;
+    }
+    root->_parent = &_header;
+    Base_ptr leftmost = root;
+    while (leftmost->_left != NULL) leftmost = leftmost->_left;
+    _header._left = leftmost;
+    Base_ptr rightmost = root;
+    while (rightmost->_right != NULL) rightmost = rightmost->_right;
+    _header._right = rightmost;
+  }
+
+  template <typename Key, typename Data, typename Compare, typename Alloc,
+            typename Rotation, typename Updater, typename Sizes>
+  void
+  avl_tree<Key,Data,Compare,Alloc,Rotation,Updater,Sizes>::_rebuild(Link_type list,
+                                                              size_type n) {
+    _node_count = n;
+    _set_root(_build(list, n, &_header));
+  }
+
+  template <typename Key, typename Data, typename Compare, typename Alloc,
+            typename Rotation, typename Updater, typename Sizes>
+  typename avl_tree<Key,Data,Compare,Alloc,Rotation,Updater,Sizes>::Link_type
+  avl_tree<Key,Data,Compare,Alloc,Rotation,Updater,Sizes>::_build(Link_type& list,
+                                                            size_type n,
+                                                            Base_ptr parent) {
+    // The left half gets the extra node: heights differ by at most one,
+    // the right side being the shorter.
+    if (n == 0)
+      return NULL;
+    size_type l = n / 2, r = n - l - 1;
+    Link_type left = _build(list, l, NULL);
+    Link_type x = list;
+    list = _right(list);
+    x->_parent = parent;
+    x->_left = left;
+    if (left != NULL)
+      left->_parent = x;
+    x->_right = _build(list, r, x);
+    int hl = 0, hr = 0;
+    for (size_type i = l; i > 0; i >>= 1) hl++;
+    for (size_type i = r; i > 0; i >>= 1) hr++;
+    x->_balance = hr - hl;
+    Sizes::set(x, n);
+    Updater::repair(x, x);
+    return x;
+  }
+
+  template <typename Key, typename Data, typename Compare, typename Alloc,
+            typename Rotation, typename Updater, typename Sizes>
+  typename avl_tree<Key,Data,Compare,Alloc,Rotation,Updater,Sizes>::size_type
+  avl_tree<Key,Data,Compare,Alloc,Rotation,Updater,Sizes>::_erase(Link_type x) {
+    // Erase without rebalancing, counting the nodes erased.
+    size_type n = 0;
     while (x != NULL) {
-      _erase(_right(x));
+      n += _erase(_right(x)) + 1;
       Link_type y = _left(x);
-      Alloc(_alloc).destroy(&x->_value);
-      _alloc.deallocate(x, 1);
+      _destroy_node(x);
       x = y;
     }
+    return n;
   }
 
   template <typename Key, typename Data, typename Compare, typename Alloc,
-            typename Rotation, typename Updater>
-  typename avl_tree<Key,Data,Compare,Alloc,Rotation,Updater>::Link_type
-  avl_tree<Key,Data,Compare,Alloc,Rotation,Updater>::_copy(Const_Link_type x,
+            typename Rotation, typename Updater, typename Sizes>
+  typename avl_tree<Key,Data,Compare,Alloc,Rotation,Updater,Sizes>::Link_type
+  avl_tree<Key,Data,Compare,Alloc,Rotation,Updater,Sizes>::_copy(Const_Link_type x,
                                                            Link_type p) {
     Link_type top = _clone_node(x);
     top->_parent = p;
@@ -0,0 +1,503 @@
+/******************************************************************************
+ *                               Benchmark
+ *                   Interval tree on synthetic workloads.
+ *
+ * Prints one JSON object per line:
+ *   {"workload":..., "structure":..., "op":..., "n":..., "ops":...,
+ *    "ns_per_op":..., "nodes_per_op":..., "matches_per_op":...,
+ *    "peak_rss_kb":...}
+ * nodes_per_op counts tree nodes visited (queries), ancestors updated
+ * (insert) or elements scanned (sorted vector baseline).
+ * After insertion, a "memory" line gives the tree's memory_usage() and,
+ * unless --no-count, the bytes counted by its allocator:
+ *   {"workload":..., "structure":..., "op":"memory", "n":..., "nodes":...,
+ *    "node_bytes":..., "payload_bytes":..., "allocator_overhead":...,
+ *    "fixed_bytes":..., "total_bytes":..., "live_bytes":...,
+ *    "allocations":...}
+ *****************************************************************************/
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <sys/resource.h>
+
+#include "counting_allocator.hpp"
+#include "interval_tree.hpp"
+
+namespace {
+
+  typedef long long          Key;
+  typedef std::pair<Key,Key> Span;
+
+  struct bench_tag;
+
+  typedef DS::interval_tree<Key, int, std::less<Key>,
+                            DS::counting_allocator<std::pair<
+                              const std::pair<const Key,const Key>,
+                              DS::interval_tree_value<Key,int> > >,
+                            DS::Interval::open,
+                            DS::Interval::counting_stats<bench_tag> >
+    Counted_tree;
+
+  typedef DS::interval_tree<Key, int> Plain_tree;
+
+  struct options {
+    std::vector<std::size_t> sizes;
+    std::vector<std::string> workloads;
+    std::size_t              queries;
+    unsigned long            seed;
+    bool                     count;
+
+    options()
+    : queries(10000), seed(42), count(true) {}
+  };
+
+  /**
+   * Workload generators.
+   * Each fills out with n intervals [low,high) and returns the end of the
+   * key space used.
+   */
+  typedef Key (*generator)(std::size_t n, std::mt19937_64& rng,
+                           std::vector<Span>& out);
+
+  Key
+  _uniform(std::size_t n, std::mt19937_64& rng, std::vector<Span>& out) {
+    const Key span = static_cast<Key>(n) * 100;
+    std::uniform_int_distribution<Key> low(0, span - 1), length(1, 200);
+    for (std::size_t i = 0; i < n; ++i) {
+      Key l = low(rng);
+      out.push_back(Span(l, l + length(rng)));
+    }
+    return span + 200;
+  }
+
+  Key
+  _clustered(std::size_t n, std::mt19937_64& rng, std::vector<Span>& out) {
+    const Key span = static_cast<Key>(n) * 100;
+    const std::size_t clusters = std::max<std::size_t>(1, n / 1000);
+    std::uniform_int_distribution<Key> center(0, span - 1), length(1, 200);
+    std::normal_distribution<double> spread(0.0, 2000.0);
+    std::vector<Key> centers(clusters);
+    for (std::size_t i = 0; i < clusters; ++i)
+      centers[i] = center(rng);
+    std::uniform_int_distribution<std::size_t> pick(0, clusters - 1);
+    for (std::size_t i = 0; i < n; ++i) {
+      Key l = centers[pick(rng)] + static_cast<Key>(spread(rng));
+      out.push_back(Span(l, l + length(rng)));
+    }
+    return span + 10000;
+  }
+
+  Key
+  _nested(std::size_t n, std::mt19937_64& rng, std::vector<Span>& out) {
+    const Key span = static_cast<Key>(n) * 100;
+    const int depth = 16;
+    std::uniform_int_distribution<Key> center(0, span - 1);
+    while (out.size() < n) {
+      Key c = center(rng);
+      for (int d = 0; d < depth && out.size() < n; ++d) {
+        Key w = static_cast<Key>(8) << d;
+        out.push_back(Span(c - w, c + w));
+      }
+    }
+    return span + (static_cast<Key>(8) << depth);
+  }
+
+  Key
+  _heavy_tailed(std::size_t n, std::mt19937_64& rng, std::vector<Span>& out) {
+    const Key span = static_cast<Key>(n) * 100;
+    std::uniform_int_distribution<Key> low(0, span - 1);
+    std::uniform_real_distribution<double> u(0.0, 1.0);
+    for (std::size_t i = 0; i < n; ++i) {
+      Key l = low(rng);
+      // Pareto lengths, alpha = 1.1, scale = 10.
+      double length = 10.0 / std::pow(1.0 - u(rng), 1.0 / 1.1);
+      out.push_back(Span(l, l + std::min<Key>(span, 1 + static_cast<Key>(length))));
+    }
+    return 2 * span;
+  }
+
+  Key
+  _monotonic(std::size_t n, std::mt19937_64& rng, std::vector<Span>& out) {
+    std::uniform_int_distribution<Key> step(1, 100), length(1, 200);
+    Key l = 0;
+    for (std::size_t i = 0; i < n; ++i) {
+      l += step(rng);
+      out.push_back(Span(l, l + length(rng)));
+    }
+    return l + 200;
+  }
+
+  struct workload {
+    const char* name;
+    generator   generate;
+  };
+
+  const workload workloads[] = {
+    { "uniform",      _uniform },
+    { "clustered",    _clustered },
+    { "nested",       _nested },
+    { "heavy_tailed", _heavy_tailed },
+    { "monotonic",    _monotonic },
+  };
+
+  /**
+   * Reporting.
+   */
+  long
+  _peak_rss_kb() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+# ifdef __APPLE__
+    return usage.ru_maxrss / 1024;
+# else
+    return usage.ru_maxrss;
+# endif
+  }
+
+  typedef std::chrono::steady_clock Clock;
+
+  double
+  _elapsed_ns(Clock::time_point start) {
+    return std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+  }
+
+  void
+  _report(const char* workload, const char* structure, const char* op,
+          std::size_t n, std::size_t ops, double ns,
+          double nodes, double matches) {
+    std::printf("{\"workload\":\"%s\",\"structure\":\"%s\",\"op\":\"%s\","
+                "\"n\":%zu,\"ops\":%zu,\"ns_per_op\":%.2f,",
+                workload, structure, op, n, ops, ops ? ns / ops : 0.0);
+    if (nodes < 0)
+      std::printf("\"nodes_per_op\":null,");
+    else
+      std::printf("\"nodes_per_op\":%.2f,", ops ? nodes / ops : 0.0);
+    if (matches < 0)
+      std::printf("\"matches_per_op\":null,");
+    else
+      std::printf("\"matches_per_op\":%.2f,", ops ? matches / ops : 0.0);
+    std::printf("\"peak_rss_kb\":%ld}\n", _peak_rss_kb());
+    std::fflush(stdout);
+  }
+
+  template <typename Alloc>
+  Alloc
+  _allocator(DS::allocation_counters&) { return Alloc(); }
+
+  template <>
+  Counted_tree::allocator_type
+  _allocator<Counted_tree::allocator_type>(DS::allocation_counters& c) {
+    return Counted_tree::allocator_type(c);
+  }
+
+  template <typename Alloc>
+  long long
+  _live_bytes(const Alloc&) { return -1; }
+
+  template <typename T>
+  long long
+  _live_bytes(const DS::counting_allocator<T>& a) {
+    return static_cast<long long>(a.counters().live_bytes.load());
+  }
+
+  template <typename Alloc>
+  long long
+  _allocations(const Alloc&) { return -1; }
+
+  template <typename T>
+  long long
+  _allocations(const DS::counting_allocator<T>& a) {
+    return static_cast<long long>(a.counters().allocations.load());
+  }
+
+  void
+  _print_count(const char* name, long long value) {
+    if (value < 0)
+      std::printf("\"%s\":null", name);
+    else
+      std::printf("\"%s\":%lld", name, value);
+  }
+
+  template <typename Tree>
+  void
+  _report_memory(const char* workload, std::size_t n, const Tree& t,
+                 const typename Tree::allocator_type& alloc) {
+    DS::tree_memory_usage m = t.memory_usage();
+    std::printf("{\"workload\":\"%s\",\"structure\":\"interval_tree\","
+                "\"op\":\"memory\",\"n\":%zu,\"nodes\":%zu,"
+                "\"node_bytes\":%zu,\"payload_bytes\":%zu,"
+                "\"allocator_overhead\":%zu,\"fixed_bytes\":%zu,"
+                "\"total_bytes\":%zu,",
+                workload, n, m.nodes, m.node_bytes, m.payload_bytes,
+                m.allocator_overhead, m.fixed_bytes, m.total());
+    _print_count("live_bytes", _live_bytes(alloc));
+    std::printf(",");
+    _print_count("allocations", _allocations(alloc));
+    std::printf("}\n");
+    std::fflush(stdout);
+  }
+
+  /**
+   * Interval tree runs.
+   * Trees keep a single interval per low end, the first one inserted.
+   */
+  template <typename Stats>
+  double
+  _nodes(const DS::Interval::stats_counters& c, bool visited) {
+    return static_cast<double>(visited ? c.visited : c.updates);
+  }
+
+  template <>
+  double
+  _nodes<DS::Interval::no_stats>(const DS::Interval::stats_counters&, bool) {
+    return -1;
+  }
+
+  template <typename Tree>
+  void
+  _bench_tree(const char* name, const std::vector<Span>& spans,
+              const std::vector<Key>& keys, const std::vector<Span>& windows,
+              std::vector<std::size_t>& key_matches,
+              std::vector<std::size_t>& window_matches) {
+    const std::size_t n = spans.size();
+    DS::allocation_counters counters;
+    typename Tree::allocator_type alloc = _allocator<typename Tree::allocator_type>(counters);
+    Tree* tree = new Tree(alloc);
+
+    Tree::reset_stats();
+    Clock::time_point start = Clock::now();
+    for (std::size_t i = 0; i < n; ++i)
+      tree->insert(std::make_pair(std::make_pair(spans[i].first, spans[i].second),
+                                  static_cast<int>(i)));
+    double ns = _elapsed_ns(start);
+    _report(name, "interval_tree", "insert", n, n, ns,
+            _nodes<typename Tree::stats_type>(Tree::stats(), false), -1);
+    _report_memory(name, n, *tree, alloc);
+
+    const Tree& t = *tree;
+    std::size_t matches = 0;
+    Tree::reset_stats();
+    start = Clock::now();
+    for (std::size_t q = 0; q < keys.size(); ++q) {
+      std::size_t m = 0;
+      for (typename Tree::point_const_iterator it = t.equal_range(keys[q]);
+           it != t.end(); ++it)
+        ++m;
+      key_matches[q] = m;
+      matches += m;
+    }
+    ns = _elapsed_ns(start);
+    _report(name, "interval_tree", "equal_range_key", n, keys.size(), ns,
+            _nodes<typename Tree::stats_type>(Tree::stats(), true), static_cast<double>(matches));
+
+    matches = 0;
+    Tree::reset_stats();
+    start = Clock::now();
+    for (std::size_t q = 0; q < windows.size(); ++q) {
+      std::size_t m = 0;
+      typename Tree::interval_type w(windows[q].first, windows[q].second);
+      for (typename Tree::const_iterator it = t.equal_range(w);
+           it != t.end(); ++it)
+        ++m;
+      window_matches[q] = m;
+      matches += m;
+    }
+    ns = _elapsed_ns(start);
+    _report(name, "interval_tree", "equal_range_interval", n, windows.size(), ns,
+            _nodes<typename Tree::stats_type>(Tree::stats(), true), static_cast<double>(matches));
+
+    start = Clock::now();
+    Tree* copy = new Tree(t);
+    ns = _elapsed_ns(start);
+    _report(name, "interval_tree", "copy", n, n, ns, -1, -1);
+
+    start = Clock::now();
+    delete copy;
+    ns = _elapsed_ns(start);
+    _report(name, "interval_tree", "destroy", n, n, ns, -1, -1);
+
+    delete tree;
+  }
+
+  /**
+   * Baseline: intervals sorted by low end, each query scans every interval
+   * starting before its high end.
+   */
+  bool
+  _low_less(const Span& x, const Span& y) {
+    return x.first < y.first;
+  }
+
+  bool
+  _low_equal(const Span& x, const Span& y) {
+    return x.first == y.first;
+  }
+
+  std::size_t
+  _scan(const std::vector<Span>& sorted, Key low, Key high,
+        std::size_t& scanned) {
+    std::vector<Span>::const_iterator end =
+      std::lower_bound(sorted.begin(), sorted.end(), Span(high, high), _low_less);
+    std::size_t m = 0;
+    for (std::vector<Span>::const_iterator it = sorted.begin(); it != end; ++it)
+      if (low < it->second)
+        ++m;
+    scanned += end - sorted.begin();
+    return m;
+  }
+
+  bool
+  _bench_baseline(const char* name, const std::vector<Span>& spans,
+                  const std::vector<Key>& keys, const std::vector<Span>& windows,
+                  const std::vector<std::size_t>& key_matches,
+                  const std::vector<std::size_t>& window_matches) {
+    const std::size_t n = spans.size();
+    // Bound the total scan work to about 2e9 elements.
+    const std::size_t queries =
+      std::min(keys.size(), std::max<std::size_t>(10, 1000000000 / n));
+    bool ok = true;
+
+    Clock::time_point start = Clock::now();
+    std::vector<Span> sorted(spans);
+    std::stable_sort(sorted.begin(), sorted.end(), _low_less);
+    sorted.erase(std::unique(sorted.begin(), sorted.end(), _low_equal),
+                 sorted.end());
+    double ns = _elapsed_ns(start);
+    _report(name, "sorted_vector", "insert", n, n, ns, -1, -1);
+
+    std::size_t matches = 0, scanned = 0;
+    start = Clock::now();
+    for (std::size_t q = 0; q < queries; ++q) {
+      // Open intervals: low < k < high.
+      std::size_t m = _scan(sorted, keys[q], keys[q], scanned);
+      ok = ok && m == key_matches[q];
+      matches += m;
+    }
+    ns = _elapsed_ns(start);
+    _report(name, "sorted_vector", "equal_range_key", n, queries, ns,
+            static_cast<double>(scanned), static_cast<double>(matches));
+
+    matches = 0, scanned = 0;
+    start = Clock::now();
+    for (std::size_t q = 0; q < queries; ++q) {
+      std::size_t m = _scan(sorted, windows[q].first, windows[q].second, scanned);
+      ok = ok && m == window_matches[q];
+      matches += m;
+    }
+    ns = _elapsed_ns(start);
+    _report(name, "sorted_vector", "equal_range_interval", n, queries, ns,
+            static_cast<double>(scanned), static_cast<double>(matches));
+    return ok;
+  }
+
+  bool
+  _run(const workload& w, std::size_t n, const options& opts) {
+    std::mt19937_64 rng(opts.seed ^ n);
+    std::vector<Span> spans;
+    spans.reserve(n);
+    const Key span = w.generate(n, rng, spans);
+
+    // Windows are wide enough to hold about ten low ends on average.
+    const Key width = std::max<Key>(1, 10 * span / static_cast<Key>(n));
+    std::uniform_int_distribution<Key> point(0, span);
+    std::vector<Key> keys(opts.queries);
+    std::vector<Span> windows(opts.queries);
+    for (std::size_t q = 0; q < opts.queries; ++q) {
+      keys[q] = point(rng);
+      Key l = point(rng);
+      windows[q] = Span(l, l + width);
+    }
+
+    std::vector<std::size_t> key_matches(opts.queries), window_matches(opts.queries);
+    if (opts.count)
+      _bench_tree<Counted_tree>(w.name, spans, keys, windows,
+                                key_matches, window_matches);
+    else
+      _bench_tree<Plain_tree>(w.name, spans, keys, windows,
+                              key_matches, window_matches);
+    if (!_bench_baseline(w.name, spans, keys, windows,
+                         key_matches, window_matches)) {
+      std::fprintf(stderr, "%s, n = %zu: interval_tree and sorted_vector disagree\n",
+                   w.name, n);
+      return false;
+    }
+    return true;
+  }
+
+  void
+  _usage(const char* argv0) {
+    std::fprintf(stderr,
+      "usage: %s [--max-size N] [--sizes N,N,...] [--queries Q]\n"
+      "          [--workload NAME]... [--seed S] [--no-count]\n"
+      "  Sizes default to the powers of ten from 1e3 to --max-size (1e6).\n"
+      "  Sizes up to 1e8 are supported given enough memory.\n"
+      "  --no-count times queries without the counting statistics policy.\n"
+      "  Workloads: uniform, clustered, nested, heavy_tailed, monotonic.\n",
+      argv0);
+  }
+
+  std::size_t
+  _parse_size(const char* s) {
+    return static_cast<std::size_t>(std::strtod(s, NULL));
+  }
+
+}
+
+int
+main(int argc, char** argv) {
+  options opts;
+  std::size_t max_size = 1000000;
+
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    bool has_value = i + 1 < argc;
+    if (arg == "--max-size" && has_value)
+      max_size = _parse_size(argv[++i]);
+    else if (arg == "--sizes" && has_value) {
+      for (const char* p = argv[++i]; *p; ) {
+        opts.sizes.push_back(_parse_size(p));
+        p = std::strchr(p, ',');
+        if (p == NULL)
+          break;
+        ++p;
+      }
+    } else if (arg == "--queries" && has_value)
+      opts.queries = _parse_size(argv[++i]);
+    else if (arg == "--workload" && has_value)
+      opts.workloads.push_back(argv[++i]);
+    else if (arg == "--seed" && has_value)
+      opts.seed = std::strtoul(argv[++i], NULL, 10);
+    else if (arg == "--no-count")
+      opts.count = false;
+    else {
+      _usage(argv[0]);
+      return arg == "--help" ? 0 : 2;
+    }
+  }
+
+  if (opts.sizes.empty())
+    for (std::size_t n = 1000; n <= max_size; n *= 10)
+      opts.sizes.push_back(n);
+
+  bool ok = true;
+  for (std::size_t i = 0; i < sizeof(workloads) / sizeof(*workloads); ++i) {
+    const workload& w = workloads[i];
+    if (!opts.workloads.empty()
+        && std::find(opts.workloads.begin(), opts.workloads.end(),
+                     std::string(w.name)) == opts.workloads.end())
+      continue;
+    for (std::size_t s = 0; s < opts.sizes.size(); ++s)
+      if (opts.sizes[s] > 0)
+        ok = _run(w, opts.sizes[s], opts) && ok;
+  }
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,151 @@
+/******************************************************************************
+ *                            Allocator
+ *                   Allocator adapter counting live bytes.
+ *****************************************************************************/
+
+#ifndef COUNTING_ALLOCATOR_HPP_
+# define COUNTING_ALLOCATOR_HPP_
+
+# include <atomic>
+# include <cstddef>
+# include <memory>
+# include <utility>
+
+# undef DS
+
+namespace DS {
+
+  /**
+   * Counters shared by a counting_allocator and all its rebound copies.
+   */
+  struct allocation_counters {
+    std::atomic<std::size_t> allocations;
+    std::atomic<std::size_t> deallocations;
+    std::atomic<std::size_t> live_bytes;
+    std::atomic<std::size_t> peak_bytes;
+
+    allocation_counters()
+    : allocations(0), deallocations(0), live_bytes(0), peak_bytes(0) {}
+
+    std::size_t
+    live_allocations() const {
+      return allocations.load(std::memory_order_relaxed)
+        - deallocations.load(std::memory_order_relaxed);
+    }
+
+    void
+    reset() {
+      allocations.store(0, std::memory_order_relaxed);
+      deallocations.store(0, std::memory_order_relaxed);
+      live_bytes.store(0, std::memory_order_relaxed);
+      peak_bytes.store(0, std::memory_order_relaxed);
+    }
+
+    /**
+     * Counters used by default constructed allocators.
+     */
+    static
+    allocation_counters&
+    global() {
+      static allocation_counters c;
+      return c;
+    }
+
+  private:
+    allocation_counters(const allocation_counters&);
+    allocation_counters& operator=(const allocation_counters&);
+  };
+
+  /**
+   * Forwards to Alloc and records the bytes requested in an
+   * allocation_counters, which can be given to the tree constructors:
+   *
+   *   DS::allocation_counters counters;
+   *   tree_type t(tree_type::allocator_type(counters));
+   */
+  template <typename T, typename Alloc = std::allocator<T> >
+  class counting_allocator {
+  public:
+    typedef T                 value_type;
+    typedef T*                pointer;
+    typedef const T*          const_pointer;
+    typedef T&                reference;
+    typedef const T&          const_reference;
+    typedef std::size_t       size_type;
+    typedef std::ptrdiff_t    difference_type;
+
+    template <typename U>
+    struct rebind {
+      typedef counting_allocator<U,
+        typename std::allocator_traits<Alloc>::template rebind_alloc<U> > other;
+    };
+
+    counting_allocator()
+    : _counters(&allocation_counters::global()) {}
+
+    explicit counting_allocator(allocation_counters& c, const Alloc& a = Alloc())
+    : _alloc(a), _counters(&c) {}
+
+    template <typename U, typename A>
+    counting_allocator(const counting_allocator<U,A>& o)
+    : _alloc(o._alloc), _counters(o._counters) {}
+
+    pointer
+    allocate(size_type n) {
+      pointer p = std::allocator_traits<Alloc>::allocate(_alloc, n);
+      std::size_t live = _counters->live_bytes.fetch_add(n * sizeof(T),
+          std::memory_order_relaxed) + n * sizeof(T);
+      std::size_t peak = _counters->peak_bytes.load(std::memory_order_relaxed);
+      while (live > peak
+             && !_counters->peak_bytes.compare_exchange_weak(peak, live,
+                 std::memory_order_relaxed))
+        ;
+      _counters->allocations.fetch_add(1, std::memory_order_relaxed);
+      return p;
+    }
+
+    void
+    deallocate(pointer p, size_type n) {
+      std::allocator_traits<Alloc>::deallocate(_alloc, p, n);
+      _counters->live_bytes.fetch_sub(n * sizeof(T), std::memory_order_relaxed);
+      _counters->deallocations.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    /**
+     * Construction is left to Alloc, the arguments being forwarded so
+     * that values are moved or built in place as Alloc would.
+     */
+    template <typename U, typename... Args>
+    void
+    construct(U* p, Args&&... args)
+    { std::allocator_traits<Alloc>::construct(_alloc, p, std::forward<Args>(args)...); }
+
+    template <typename U>
+    void
+    destroy(U* p)
+    { std::allocator_traits<Alloc>::destroy(_alloc, p); }
+
+    allocation_counters&
+    counters() const
+    { return *_counters; }
+
+    template <typename U, typename A>
+    bool
+    operator==(const counting_allocator<U,A>& o) const
+    { return _counters == o._counters; }
+
+    template <typename U, typename A>
+    bool
+    operator!=(const counting_allocator<U,A>& o) const
+    { return _counters != o._counters; }
+
+  private:
+    template <typename U, typename A> friend class counting_allocator;
+
+    Alloc                _alloc;
+    allocation_counters* _counters;
+  };
+
+}
+
+#endif /* !COUNTING_ALLOCATOR_HPP_ */
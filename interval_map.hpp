@@ -0,0 +1,197 @@
+/******************************************************************************
+ *                            Data Structure
+ *              Map of disjoint intervals to values, on an AVL tree.
+ *****************************************************************************/
+
+#ifndef _interval_MAP_HPP_
+# define _interval_MAP_HPP_
+
+# include <cstddef>
+# include <functional>
+# include <memory>
+# include <utility>
+
+# include "avl_tree.hpp"
+
+# undef DS
+
+namespace DS {
+
+  /**
+   * Each node holds the high end of its interval, the low end being the
+   * key it is ordered by.
+   */
+  template <typename Key, typename Data>
+  struct interval_map_value {
+    Key high;
+    Data data;
+  };
+
+  /**
+   * Map of disjoint right open intervals [low,high) to values, in the
+   * style of boost::icl::interval_map with assignment semantics:
+   * assigning a value to an interval cuts the intervals it overlaps, then
+   * coalesces it with the neighbours it touches holding an equal value.
+   * Intervals being disjoint, a lookup is a single predecessor search on
+   * the low ends and needs no max augmentation.
+   *
+   * Iterators give access to pair<const Key, interval_map_value>; the high
+   * ends must not be changed through them.
+   */
+  template <typename Key,
+            typename Data,
+            typename Compare = std::less<Key>,
+            typename Alloc = std::allocator<std::pair<const Key,
+              interval_map_value<Key,Data> > > >
+  class interval_map : private avl_tree<Key,
+                                        interval_map_value<Key,Data>,
+                                        Compare,
+                                        Alloc>
+  {
+    typedef avl_tree<Key,interval_map_value<Key,Data>,Compare,Alloc> Base_type;
+    typedef typename Base_type::Link_type      Link_type;
+    typedef typename Base_type::Const_Link_type Const_Link_type;
+    typedef interval_map_value<Key,Data>        Segment;
+
+  public:
+    typedef Key                                 key_type;
+    typedef Data                                mapped_type;
+    typedef std::pair<const Key,const Key>      interval_type;
+    typedef typename Base_type::value_type      value_type;
+    typedef Compare                             key_compare;
+    typedef Alloc                               allocator_type;
+    typedef typename Base_type::size_type       size_type;
+    typedef typename Base_type::iterator        iterator;
+    typedef typename Base_type::const_iterator  const_iterator;
+
+    using Base_type::begin;
+    using Base_type::end;
+    using Base_type::size;
+    using Base_type::empty;
+    using Base_type::get_allocator;
+    using Base_type::memory_usage;
+
+    interval_map() {}
+
+    explicit interval_map(const Alloc& a)
+    : Base_type(a) {}
+
+    /**
+     * The interval containing k, or end(). O(log n).
+     */
+    iterator
+    find(const Key& k)
+    { return iterator(const_cast<Link_type>(_find(k))); }
+
+    const_iterator
+    find(const Key& k) const
+    { return const_iterator(_find(k)); }
+
+    /**
+     * Map the interval i to d, cutting or erasing the intervals it
+     * overlaps and coalescing it with equal touching neighbours.
+     * O(log n + m) for m intervals overlapped.
+     */
+    void
+    assign(const interval_type& i, const Data& d) {
+      if (!this->_compare(i.first, i.second))
+        return;
+      _cut(i.first, i.second);
+      Segment s = { i.second, d };
+      _coalesce(Base_type::insert(value_type(i.first, s)).first);
+    }
+
+    /**
+     * Unmap the interval i, cutting or erasing the intervals it overlaps.
+     * O(log n + m) for m intervals overlapped.
+     */
+    void
+    erase(const interval_type& i) {
+      if (this->_compare(i.first, i.second))
+        _cut(i.first, i.second);
+    }
+
+  private:
+    /**
+     * Last interval whose low end is not after k, or end().
+     */
+    Const_Link_type
+    _floor(const Key& k) const {
+      Const_Link_type x = this->_begin(), y = this->_end();
+      while (x != NULL) {
+        if (this->_compare(k, x->_value.first)) {
+          x = Base_type::_left(x);
+        } else {
+          y = x;
+          x = Base_type::_right(x);
+        }
+      }
+      return y;
+    }
+
+    Const_Link_type
+    _find(const Key& k) const {
+      Const_Link_type x = _floor(k);
+      if (x != this->_end() && this->_compare(k, x->_value.second.high))
+        return x;
+      return this->_end();
+    }
+
+    /**
+     * Leave [low,high) unmapped, keeping the parts of the intervals
+     * overlapping it that lie outside. The intervals starting inside are
+     * split out and destroyed together, so only the ends are searched.
+     */
+    void
+    _cut(const Key& low, const Key& high) {
+      const Compare& compare = this->_compare;
+      Link_type x = const_cast<Link_type>(_floor(low));
+      if (x != this->_end() && compare(x->_value.first, low)
+          && compare(low, x->_value.second.high)) {
+        Segment rest = x->_value.second;
+        x->_value.second.high = low;
+        if (compare(high, rest.high)) {
+          Base_type::insert(value_type(high, rest));
+          return;
+        }
+      }
+      iterator last = Base_type::lower_bound(high);
+      if (last != begin() && !compare((--last)->first, low)
+          && compare(high, last->second.high)) {
+        this->_erase_range(low, last->first);
+        Base_type::insert(value_type(high, last->second));
+        Base_type::erase(last);
+      } else {
+        this->_erase_range(low, high);
+      }
+    }
+
+    /**
+     * Merge x with the intervals just before and after it when they touch
+     * it and hold an equal value.
+     */
+    void
+    _coalesce(iterator x) {
+      const Compare& compare = this->_compare;
+      if (x != begin()) {
+        iterator prev = x;
+        --prev;
+        if (!compare(prev->second.high, x->first)
+            && prev->second.data == x->second.data) {
+          prev->second.high = x->second.high;
+          Base_type::erase(x);
+          x = prev;
+        }
+      }
+      iterator next = x;
+      ++next;
+      if (next != end() && !compare(x->second.high, next->first)
+          && next->second.data == x->second.data) {
+        x->second.high = next->second.high;
+        Base_type::erase(next);
+      }
+    }
+  };
+}
+
+#endif
@@ -7,6 +7,20 @@
 #ifndef INTERVAL_TREE_HPP_
 # define INTERVAL_TREE_HPP_
 
+# include <algorithm>
+# include <atomic>
+# include <cstddef>
+# include <cstdint>
+# include <future>
+# include <iterator>
+# include <limits>
+# include <memory>
+# include <random>
+# include <tuple>
+# include <type_traits>
+# include <utility>
+# include <vector>
+
 # include "avl_tree.hpp"
 
 # undef DS
@@ -18,14 +32,49 @@ namespace DS {
    * - the upper interval limit
    * - the maximal value among the high ends of the intervals
    * - the minimal value among the low ends of the intervals
+   * - the minimal value among the high ends of the intervals
+   * - a bound on the largest gap between the intervals, under the
+   *   Interval::track_gaps policy
+   * - the aggregate of the Aggregate policy, if any
    * rooted below the node.
    */
-  template <typename Key, typename Data>
-  struct interval_tree_value {
+  template <typename Value>
+  struct _interval_aggregate {
+    Value aggregate;
+  };
+
+  template <>
+  struct _interval_aggregate<void> {};
+
+  template <typename Key>
+  struct _interval_gap {
+    _interval_gap() : gap() {}
+
+    Key gap;
+  };
+
+  template <>
+  struct _interval_gap<void> {};
+
+  template <typename Key, typename Data, typename Aggregate = void,
+            typename Gap = void>
+  struct interval_tree_value : _interval_aggregate<Aggregate>, _interval_gap<Gap> {
     Key max;
     Key min;
+    Key min_high;
     Data data;
     operator Data() const { return data; }
+
+    interval_tree_value()
+    : max(), min(), min_high() {}
+
+    /**
+     * Construct data from args in place, the augmentation being set when
+     * the node is linked into the tree.
+     */
+    template <typename... Args>
+    explicit interval_tree_value(std::piecewise_construct_t, Args&&... args)
+    : max(), min(), min_high(), data(std::forward<Args>(args)...) {}
   };
 
   /**
@@ -44,27 +93,361 @@ namespace DS {
   };
 
   /**
-   * Overlapping predicate.
+   * Endpoint policies.
+   * Tell whether the low and high ends belong to the intervals:
+   * - open       (a,b)
+   * - closed     [a,b]
+   * - right_open [a,b)
+   * - left_open  (a,b]
+   * point_type is the policy used when querying a single key k, which
+   * is always the closed interval [k,k] except for open intervals where
+   * the query endpoints do not matter.
    */
-  template <typename Key, typename Compare>
+  namespace Interval {
+    struct open {
+      enum { low_closed = false, high_closed = false };
+      typedef open point_type;
+    };
+
+    struct closed {
+      enum { low_closed = true, high_closed = true };
+      typedef closed point_type;
+    };
+
+    struct right_open {
+      enum { low_closed = true, high_closed = false };
+      typedef closed point_type;
+    };
+
+    struct left_open {
+      enum { low_closed = false, high_closed = true };
+      typedef closed point_type;
+    };
+
+    /**
+     * Whether a low end a comes before a high end b, that is a < b, or
+     * a <= b when both ends are closed.
+     */
+    template <bool Closed>
+    struct _before {
+      template <typename Compare, typename Key>
+      static
+      bool
+      apply(const Compare& compare, const Key& a, const Key& b)
+      { return compare(a, b); }
+    };
+
+    template <>
+    struct _before<true> {
+      template <typename Compare, typename Key>
+      static
+      bool
+      apply(const Compare& compare, const Key& a, const Key& b)
+      { return !compare(b, a); }
+    };
+  }
+
+  /**
+   * Overlapping predicate between a query interval with endpoints Query
+   * and a stored interval with endpoints Endpoint.
+   */
+  template <typename Key,
+            typename Compare,
+            typename Endpoint = Interval::open,
+            typename Query = Endpoint>
   struct Interval_overlap {
     typedef std::pair<const Key,const Key> interval_type;
 
     bool operator()(const interval_type& x, const interval_type& y) const {
-      return compare(x.first, y.second) && compare(y.first, x.second);
+      return max_reaches(x, y.second) && min_reaches(y.first, x);
+    }
+
+    /**
+     * Whether intervals whose highest end is max may overlap x.
+     */
+    bool max_reaches(const interval_type& x, const Key& max) const {
+      return Interval::_before<Query::low_closed && Endpoint::high_closed>
+        ::apply(compare, x.first, max);
+    }
+
+    /**
+     * Whether intervals whose lowest end is min may overlap x.
+     */
+    bool min_reaches(const Key& min, const interval_type& x) const {
+      return Interval::_before<Endpoint::low_closed && Query::high_closed>
+        ::apply(compare, min, x.second);
     }
 
   private:
     Compare compare;
   };
 
+  /**
+   * Statistics policies.
+   * The tree reports the work done by queries, insertions, rotations and
+   * node allocations to its Stats policy through static hooks. Each query
+   * iterator also derives from Stats::tally, which keeps the work of that
+   * query alone. no_stats ignores them all, so that the counting code
+   * compiles away.
+   */
+  namespace Interval {
+    struct stats_counters {
+      std::size_t queries;     // calls to equal_range
+      std::size_t visited;     // nodes popped by the iterators
+      std::size_t pruned;      // subtrees skipped thanks to max/min
+      std::size_t matched;     // intervals returned
+      std::size_t rotations;
+      std::size_t updates;     // ancestors updated on insertion and erasure
+      std::size_t allocations; // nodes allocated
+
+      stats_counters()
+      : queries(0), visited(0), pruned(0), matched(0),
+        rotations(0), updates(0), allocations(0) {}
+    };
+
+    /**
+     * Work done by a single query so far, from its iterator's stats().
+     */
+    struct query_stats {
+      std::size_t visited;
+      std::size_t pruned;
+      std::size_t matched;
+
+      query_stats()
+      : visited(0), pruned(0), matched(0) {}
+    };
+
+    struct _no_tally {
+      void _tally(std::size_t, std::size_t, std::size_t) {}
+
+      query_stats stats() const { return query_stats(); }
+    };
+
+    struct _query_tally {
+      void
+      _tally(std::size_t visited, std::size_t pruned, std::size_t matched) {
+        _stats.visited += visited;
+        _stats.pruned += pruned;
+        _stats.matched += matched;
+      }
+
+      query_stats stats() const { return _stats; }
+
+      query_stats _stats;
+    };
+
+    struct no_stats {
+      typedef _no_tally tally;
+
+      static void query() {}
+      static void traverse(std::size_t, std::size_t, std::size_t) {}
+      static void rotate() {}
+      static void update() {}
+      static void allocate(std::size_t) {}
+
+      static stats_counters snapshot() { return stats_counters(); }
+      static void reset() {}
+    };
+
+    /**
+     * Counters shared by all trees using the same Tag, safe to bump from
+     * concurrent readers and batch threads: give each tree its own Tag to tell them apart.
+     * Iterators add their visited and pruned counts once per returned
+     * match rather than once per node, and keep them for their own query.
+     */
+    template <typename Tag = void>
+    struct counting_stats {
+      typedef _query_tally tally;
+
+      static void query()
+      { _counters().queries.fetch_add(1, std::memory_order_relaxed); }
+
+      static void traverse(std::size_t visited, std::size_t pruned,
+                           std::size_t matched) {
+        _atomic_counters& c = _counters();
+        c.visited.fetch_add(visited, std::memory_order_relaxed);
+        c.pruned.fetch_add(pruned, std::memory_order_relaxed);
+        c.matched.fetch_add(matched, std::memory_order_relaxed);
+      }
+
+      static void rotate()
+      { _counters().rotations.fetch_add(1, std::memory_order_relaxed); }
+
+      static void update()
+      { _counters().updates.fetch_add(1, std::memory_order_relaxed); }
+
+      static void allocate(std::size_t n)
+      { _counters().allocations.fetch_add(n, std::memory_order_relaxed); }
+
+      static stats_counters snapshot() {
+        _atomic_counters& c = _counters();
+        stats_counters s;
+        s.queries = c.queries.load(std::memory_order_relaxed);
+        s.visited = c.visited.load(std::memory_order_relaxed);
+        s.pruned = c.pruned.load(std::memory_order_relaxed);
+        s.matched = c.matched.load(std::memory_order_relaxed);
+        s.rotations = c.rotations.load(std::memory_order_relaxed);
+        s.updates = c.updates.load(std::memory_order_relaxed);
+        s.allocations = c.allocations.load(std::memory_order_relaxed);
+        return s;
+      }
+
+      static void reset() {
+        _atomic_counters& c = _counters();
+        c.queries.store(0, std::memory_order_relaxed);
+        c.visited.store(0, std::memory_order_relaxed);
+        c.pruned.store(0, std::memory_order_relaxed);
+        c.matched.store(0, std::memory_order_relaxed);
+        c.rotations.store(0, std::memory_order_relaxed);
+        c.updates.store(0, std::memory_order_relaxed);
+        c.allocations.store(0, std::memory_order_relaxed);
+      }
+
+    private:
+      struct _atomic_counters {
+        std::atomic<std::size_t> queries;
+        std::atomic<std::size_t> visited;
+        std::atomic<std::size_t> pruned;
+        std::atomic<std::size_t> matched;
+        std::atomic<std::size_t> rotations;
+        std::atomic<std::size_t> updates;
+        std::atomic<std::size_t> allocations;
+      };
+
+      static
+      _atomic_counters&
+      _counters() {
+        static _atomic_counters c = { {0}, {0}, {0}, {0}, {0}, {0}, {0} };
+        return c;
+      }
+    };
+  }
+
+  namespace Interval {
+    /**
+     * Keeps the work of each query in its iterator alone, for the
+     * diagnostics of trees under any Stats policy.
+     */
+    struct _visit_stats : no_stats {
+      typedef _query_tally tally;
+    };
+
+    /**
+     * Forwards to Alloc, reporting the nodes allocated to Stats, whatever
+     * the path that allocates them.
+     */
+    template <typename Alloc, typename Stats>
+    struct _stats_allocator : Alloc {
+      typedef std::allocator_traits<Alloc> _traits;
+      typedef typename _traits::value_type value_type;
+      typedef typename _traits::pointer    pointer;
+      typedef typename _traits::size_type  size_type;
+
+      template <typename U>
+      struct rebind {
+        typedef _stats_allocator<typename _traits::template rebind_alloc<U>,
+                                 Stats> other;
+      };
+
+      _stats_allocator() {}
+
+      _stats_allocator(const Alloc& a)
+      : Alloc(a) {}
+
+      template <typename A>
+      _stats_allocator(const _stats_allocator<A,Stats>& o)
+      : Alloc(static_cast<const A&>(o)) {}
+
+      pointer
+      allocate(size_type n) {
+        pointer p = _traits::allocate(*this, n);
+        Stats::allocate(n);
+        return p;
+      }
+    };
+  }
+
+  /**
+   * Aggregate policies.
+   * Each node can also hold an aggregate of the intervals rooted below it,
+   * combined in low order with an associative combine of identity
+   * identity(), from value(interval, data) for each interval:
+   *
+   *   typedef ... value_type;
+   *   static value_type identity();
+   *   static value_type combine(const value_type&, const value_type&);
+   *   template <typename Interval, typename Data>
+   *   static value_type value(const Interval&, const Data&);
+   *
+   * no_aggregate, the default, stores nothing.
+   */
+  namespace Interval {
+    struct no_aggregate {
+      typedef void value_type;
+    };
+
+    struct count_aggregate {
+      typedef std::size_t value_type;
+
+      static value_type identity() { return 0; }
+
+      static value_type combine(value_type x, value_type y) { return x + y; }
+
+      template <typename I, typename Data>
+      static value_type value(const I&, const Data&) { return 1; }
+    };
+
+    template <typename T>
+    struct sum_aggregate {
+      typedef T value_type;
+
+      static value_type identity() { return T(); }
+
+      static value_type combine(const T& x, const T& y) { return x + y; }
+
+      template <typename I, typename Data>
+      static value_type value(const I&, const Data& d) { return T(d); }
+    };
+
+    template <typename T>
+    struct max_aggregate {
+      typedef T value_type;
+
+      static value_type identity() { return std::numeric_limits<T>::lowest(); }
+
+      static value_type combine(const T& x, const T& y) { return std::max(x, y); }
+
+      template <typename I, typename Data>
+      static value_type value(const I&, const Data& d) { return T(d); }
+    };
+  }
+
+  /**
+   * Gap policies.
+   * track_gaps keeps in each node a bound on the largest gap between the
+   * intervals rooted below it, letting find_gap and gaps skip subtrees.
+   * no_gaps, the default, stores nothing and those walk every subtree
+   * reaching past the current position.
+   */
+  namespace Interval {
+    struct no_gaps {
+      template <typename Key>
+      struct bound { typedef void type; };
+    };
+
+    struct track_gaps {
+      template <typename Key>
+      struct bound { typedef Key type; };
+    };
+  }
+
   /**
    * Forward iterator compatible with the STL
    */
 # define STACK_SIZE 64
 
-  template <typename Tree>
-  struct _interval_iterator {
+  template <typename Tree, typename Query = typename Tree::endpoint_type>
+  struct _interval_iterator : Tree::stats_type::tally {
     typedef typename Tree::Base_type::value_type Pointee;
     typedef Pointee  value_type;
     typedef Pointee& reference;
@@ -73,17 +456,25 @@ namespace DS {
     typedef std::forward_iterator_tag       iterator_category;
     typedef ptrdiff_t                       difference_type;
 
-    typedef _interval_iterator<Tree>          Self;
+    typedef _interval_iterator<Tree,Query>    Self;
     typedef typename Pointee::first_type      interval_type;
-    typedef _avl_tree_node<Pointee>*          Link_type;
+    typedef typename Tree::ordered_iterator::Link_type Link_type;
     typedef typename Tree::Base_ptr           Base_ptr;
 
     _interval_iterator(Link_type root, const interval_type& i, Link_type e)
     : _interval(i), _end(e), _sp(0) {
-      _stack[_sp++] = root;
+      if (root != NULL && root != e)
+        _stack[_sp++] = root;
       _forward();
     }
 
+    /**
+     * Iterator on the interval of x alone, as returned by insert and find:
+     * incrementing it gives end().
+     */
+    _interval_iterator(Link_type x, Link_type e)
+    : _node(x), _interval(x->_value.first), _end(e), _sp(0) {}
+
     reference
     operator*() const
     { return static_cast<Link_type>(_node)->_value; }
@@ -116,19 +507,33 @@ namespace DS {
     void
     _forward() {
       Interval_overlap<typename Tree::key_type,
-                       typename Tree::key_compare> _overlap;
-      typename Tree::key_compare                   _compare;
+                       typename Tree::key_compare,
+                       typename Tree::endpoint_type,
+                       Query>                       _overlap;
+      std::size_t visited = 0, pruned = 0;
       while (_sp > 0) {
         _node = _stack[--_sp];
-        if (_node->_left != NULL
-            && _compare(_interval.first, Tree::_left(_node)->_value.second.max))
-          _stack[_sp++] = _node->_left;
-        if (_node->_right != NULL
-                 && _compare(Tree::_right(_node)->_value.second.min, _interval.second))
-          _stack[_sp++] = _node->_right;
-        if (_overlap(_interval, static_cast<Link_type>(_node)->_value.first))
+        ++visited;
+        if (_node->_left != NULL) {
+          if (_overlap.max_reaches(_interval, Tree::_left(_node)->_value.second.max))
+            _stack[_sp++] = _node->_left;
+          else
+            ++pruned;
+        }
+        if (_node->_right != NULL) {
+          if (_overlap.min_reaches(Tree::_right(_node)->_value.second.min, _interval))
+            _stack[_sp++] = _node->_right;
+          else
+            ++pruned;
+        }
+        if (_overlap(_interval, static_cast<Link_type>(_node)->_value.first)) {
+          Tree::stats_type::traverse(visited, pruned, 1);
+          this->_tally(visited, pruned, 1);
           return;
+        }
       }
+      Tree::stats_type::traverse(visited, pruned, 0);
+      this->_tally(visited, pruned, 0);
       _node = _end;
     }
 
@@ -139,8 +544,9 @@ namespace DS {
     int                 _sp;
   };
 
-  template <typename Tree>
-  struct _interval_const_iterator {
+  template <typename Tree, typename Query = typename Tree::endpoint_type,
+            typename Stats = typename Tree::stats_type>
+  struct _interval_const_iterator : Stats::tally {
     typedef typename Tree::Base_type::value_type Pointee;
     typedef Pointee        value_type;
     typedef const Pointee& reference;
@@ -149,19 +555,23 @@ namespace DS {
     typedef std::forward_iterator_tag       iterator_category;
     typedef ptrdiff_t                       difference_type;
 
-    typedef _interval_const_iterator<Tree>    Self;
+    typedef _interval_const_iterator<Tree,Query,Stats> Self;
     typedef typename Pointee::first_type      interval_type;
-    typedef const _avl_tree_node<Pointee>*    Link_type;
+    typedef typename Tree::const_ordered_iterator::Link_type Link_type;
     typedef typename Tree::Const_Base_ptr     Const_Base_ptr;
 
     _interval_const_iterator(Link_type root, const interval_type& i, Link_type e)
     : _interval(i), _end(e), _sp(0) {
-      _stack[_sp++] = root;
+      if (root != NULL && root != e)
+        _stack[_sp++] = root;
       _forward();
     }
 
-    _interval_const_iterator(const _interval_iterator<Tree>& it)
-    : _node(it._node), _interval(it._interval), _end(it._end), _sp(it._sp) {
+    _interval_const_iterator(Link_type x, Link_type e)
+    : _node(x), _interval(x->_value.first), _end(e), _sp(0) {}
+
+    _interval_const_iterator(const _interval_iterator<Tree,Query>& it)
+    : Stats::tally(it), _node(it._node), _interval(it._interval), _end(it._end), _sp(it._sp) {
       for (int i = 0; i <_sp; ++i)
         _stack[i] = it._stack[i];
     }
@@ -198,19 +608,33 @@ namespace DS {
     void
     _forward() {
       Interval_overlap<typename Tree::key_type,
-                       typename Tree::key_compare> _overlap;
-      typename Tree::key_compare                   _compare;
+                       typename Tree::key_compare,
+                       typename Tree::endpoint_type,
+                       Query>                       _overlap;
+      std::size_t visited = 0, pruned = 0;
       while (_sp > 0) {
         _node = _stack[--_sp];
-        if (_node->_left != NULL
-            && _compare(_interval.first, Tree::_left(_node)->_value.second.max))
-          _stack[_sp++] = _node->_left;
-        if (_node->_right != NULL
-                 && _compare(Tree::_right(_node)->_value.second.min, _interval.second))
-          _stack[_sp++] = _node->_right;
-        if (_overlap(_interval, static_cast<Link_type>(_node)->_value.first))
+        ++visited;
+        if (_node->_left != NULL) {
+          if (_overlap.max_reaches(_interval, Tree::_left(_node)->_value.second.max))
+            _stack[_sp++] = _node->_left;
+          else
+            ++pruned;
+        }
+        if (_node->_right != NULL) {
+          if (_overlap.min_reaches(Tree::_right(_node)->_value.second.min, _interval))
+            _stack[_sp++] = _node->_right;
+          else
+            ++pruned;
+        }
+        if (_overlap(_interval, static_cast<Link_type>(_node)->_value.first)) {
+          Stats::traverse(visited, pruned, 1);
+          this->_tally(visited, pruned, 1);
           return;
+        }
       }
+      Stats::traverse(visited, pruned, 0);
+      this->_tally(visited, pruned, 0);
       _node = _end;
     }
 
@@ -221,211 +645,2458 @@ namespace DS {
     int                 _sp;
   };
 
-  template <typename Tree>
+  /**
+   * Iterators of one tree compare equal when on the same node, whatever
+   * their queries: equal_range(k) on a half open tree gives a closed
+   * point query, to be compared with the end() of the tree's endpoints.
+   */
+  template <typename Tree, typename Q1, typename Q2, typename S>
   inline bool
-  operator==(const _interval_iterator<Tree>& x,
-             const _interval_const_iterator<Tree>& y)
+  operator==(const _interval_iterator<Tree,Q1>& x,
+             const _interval_const_iterator<Tree,Q2,S>& y)
   { return x._node == y._node; }
 
-  template <typename Tree>
+  template <typename Tree, typename Q1, typename Q2, typename S>
+  inline bool
+  operator!=(const _interval_iterator<Tree,Q1>& x,
+             const _interval_const_iterator<Tree,Q2,S>& y)
+  { return x._node != y._node; }
+
+  template <typename Tree, typename Q1, typename S, typename Q2>
+  inline bool
+  operator==(const _interval_const_iterator<Tree,Q1,S>& x,
+             const _interval_iterator<Tree,Q2>& y)
+  { return x._node == y._node; }
+
+  template <typename Tree, typename Q1, typename S, typename Q2>
+  inline bool
+  operator!=(const _interval_const_iterator<Tree,Q1,S>& x,
+             const _interval_iterator<Tree,Q2>& y)
+  { return x._node != y._node; }
+
+  template <typename Tree, typename Q1, typename Q2>
+  inline bool
+  operator==(const _interval_iterator<Tree,Q1>& x,
+             const _interval_iterator<Tree,Q2>& y)
+  { return x._node == y._node; }
+
+  template <typename Tree, typename Q1, typename Q2>
   inline bool
-  operator!=(const _interval_iterator<Tree>& x,
-             const _interval_const_iterator<Tree>& y)
+  operator!=(const _interval_iterator<Tree,Q1>& x,
+             const _interval_iterator<Tree,Q2>& y)
   { return x._node != y._node; }
 
+  template <typename Tree, typename Q1, typename S1, typename Q2, typename S2>
+  inline bool
+  operator==(const _interval_const_iterator<Tree,Q1,S1>& x,
+             const _interval_const_iterator<Tree,Q2,S2>& y)
+  { return x._node == y._node; }
+
+  template <typename Tree, typename Q1, typename S1, typename Q2, typename S2>
+  inline bool
+  operator!=(const _interval_const_iterator<Tree,Q1,S1>& x,
+             const _interval_const_iterator<Tree,Q2,S2>& y)
+  { return x._node != y._node; }
 
   /**
-   * Augmented tree implementation.
-   * Cormen et al. (2001, Section 14.3: Interval trees, pp. 311–317)
-   *
-   * Use a simple self-balancing binary search tree, where the tree is ordered
-   * by the 'low' values of the intervals, and an extra annotation is added to
-   * every node recording the maximum high value of both its subtrees.
-   * It is simple to maintain this attribute in only O(h) steps during each
-   * addition or removal of a node, where h is the height of the node added or
-   * removed in the tree, by updating all ancestors of the node from the bottom
-   * up.
-   * Additionally, the tree rotations used during insertion and deletion
-   * require updating the max value of the affected nodes.
+   * Iterator on the intervals overlapping a query by increasing low end,
+   * or decreasing when Ascending is false. It walks the tree in order
+   * through the parent links, entering a subtree only when its max and
+   * min reach the query as _forward does, so nothing is sorted afterwards
+   * and the state is a single node.
    */
-  template <typename Key,
-            typename Data,
-            typename Compare,
-            typename Alloc>
-  class interval_tree;
-
-  namespace Interval {
-    typedef _avl_tree_node_base*                  Node_ptr;
+  template <typename Tree, bool Ascending,
+            typename Query = typename Tree::endpoint_type>
+  struct _interval_sorted_iterator : Tree::stats_type::tally {
+    typedef typename Tree::Base_type::value_type Pointee;
+    typedef Pointee        value_type;
+    typedef const Pointee& reference;
+    typedef const Pointee* pointer;
 
-    template <typename Tree>
-    struct rotation {
-      static
-      void
-      left(Node_ptr x,
-           Node_ptr& root) {
-        AVL::rotation::left(x, root);
-        _update_min_max(x);
-      }
+    typedef std::forward_iterator_tag       iterator_category;
+    typedef ptrdiff_t                       difference_type;
 
-      static
-      void
-      right(Node_ptr x,
-            Node_ptr& root) {
-        AVL::rotation::right(x, root);
-        _update_min_max(x);
-      }
+    typedef _interval_sorted_iterator<Tree,Ascending,Query> Self;
+    typedef typename Pointee::first_type      interval_type;
+    typedef typename Tree::const_ordered_iterator::Link_type Link_type;
+    typedef typename Tree::Const_Base_ptr     Const_Base_ptr;
 
-    private:
-      static
-      void
-      _update_min_max(Node_ptr x) {
-        typename Tree::Link_type node = static_cast<typename Tree::Link_type>(x);
-        Tree::_parent(node)->_value.second.max = node->_value.second.max;
-        Tree::_parent(node)->_value.second.min = node->_value.second.min;
-        node->_value.second.max = node->_value.first.second;
-        node->_value.second.min = node->_value.first.first;
-        typename Tree::key_type& max_subtree = node->_value.second.max;
-        typename Tree::key_type& min_subtree = node->_value.second.min;
-        if (node->_left != NULL) {
-          max_subtree = std::max(max_subtree, Tree::_left(node)->_value.second.max);
-          min_subtree = std::min(min_subtree, Tree::_left(node)->_value.second.min);
-        }
-        if (node->_right != NULL) {
-          max_subtree = std::max(max_subtree, Tree::_right(node)->_value.second.max);
-          min_subtree = std::min(min_subtree, Tree::_right(node)->_value.second.min);
-        }
-      }
-    };
+    _interval_sorted_iterator(Link_type root, const interval_type& i, Link_type e)
+    : _node(e), _interval(i), _end(e) {
+      std::size_t visited = 0, pruned = 0;
+      if (root != NULL && root != e)
+        _node = _first_in(root, visited, pruned);
+      _report(visited, pruned);
+    }
 
-    template <typename Tree>
-    struct updater {
-      static
-      void
-      update(Node_ptr x, Node_ptr& unbalanced, Node_ptr& root) {
-        // Update balances bottom-up.
-        bool unbalance_switch = false;
-        typename Tree::Link_type leaf = static_cast<typename Tree::Link_type>(x);
-        for (;;) {
-          typename Tree::Link_type p = static_cast<typename Tree::Link_type>(leaf->_parent);
-          if (!unbalance_switch) {
-            if (p->_left == leaf)
-              p->_balance--;
-            else
-              p->_balance++;
-          }
-          p->_value.second.max = std::max(leaf->_value.second.max, p->_value.second.max);
-          p->_value.second.min = std::min(leaf->_value.second.min, p->_value.second.min);
-          if (p == root) // up to the root
-            break;
-          if (p == unbalanced)
-            unbalance_switch = true;
-          leaf = p;
-        }
-      }
-    };
-  }
+    /**
+     * Iterator resuming past the low end k, in the direction of the
+     * iteration, whether or not an interval starts at k.
+     */
+    _interval_sorted_iterator(Link_type root, const interval_type& i, Link_type e,
+                              const typename Tree::key_type& k)
+    : _node(e), _interval(i), _end(e) {
+      std::size_t visited = 0, pruned = 0;
+      if (root != NULL && root != e)
+        _node = _first_past(root, k, visited, pruned);
+      _report(visited, pruned);
+    }
 
+    reference
+    operator*() const
+    { return static_cast<Link_type>(_node)->_value; }
+
+    pointer
+    operator->() const
+    { return &static_cast<Link_type>(_node)->_value; }
+
+    Self&
+    operator++() {
+      std::size_t visited = 0, pruned = 0;
+      _node = _next(_node, visited, pruned);
+      _report(visited, pruned);
+      return *this;
+    }
+
+    Self
+    operator++(int) {
+      Self tmp = *this;
+      ++*this;
+      return tmp;
+    }
+
+    bool
+    operator==(const Self& x) const
+    { return _node == x._node; }
+
+    bool
+    operator!=(const Self& x) const
+    { return _node != x._node; }
+
+    static
+    Const_Base_ptr
+    _near(Const_Base_ptr x)
+    { return Ascending ? x->_left : x->_right; }
+
+    static
+    Const_Base_ptr
+    _far(Const_Base_ptr x)
+    { return Ascending ? x->_right : x->_left; }
+
+    bool
+    _reaches(Const_Base_ptr x) const {
+      const typename Tree::mapped_type& v = Tree::_value(x).second;
+      return _overlap.max_reaches(_interval, v.max)
+        && _overlap.min_reaches(v.min, _interval);
+    }
+
+    /**
+     * First match in the subtree x, in the direction of the iteration,
+     * or the end.
+     */
+    Const_Base_ptr
+    _first_in(Const_Base_ptr x, std::size_t& visited, std::size_t& pruned) const {
+      for (; x != NULL; x = _far(x)) {
+        ++visited;
+        if (!_reaches(x)) {
+          ++pruned;
+          break;
+        }
+        if (_near(x) != NULL) {
+          Const_Base_ptr y = _first_in(_near(x), visited, pruned);
+          if (y != _end)
+            return y;
+        }
+        if (_overlap(_interval, Tree::_value(x).first))
+          return x;
+      }
+      return _end;
+    }
+
+    /**
+     * First match in the subtree x whose low end is past k: the nodes not
+     * past k are skipped with their near subtrees on the way down.
+     */
+    Const_Base_ptr
+    _first_past(Const_Base_ptr x, const typename Tree::key_type& k,
+                std::size_t& visited, std::size_t& pruned) const {
+      typename Tree::key_compare compare;
+      for (; x != NULL; x = _far(x)) {
+        ++visited;
+        if (!_reaches(x)) {
+          ++pruned;
+          break;
+        }
+        const typename Tree::key_type& low = Tree::_value(x).first.first;
+        if (Ascending ? !compare(k, low) : !compare(low, k))
+          continue;
+        if (_near(x) != NULL) {
+          Const_Base_ptr y = _first_past(_near(x), k, visited, pruned);
+          if (y != _end)
+            return y;
+        }
+        if (_overlap(_interval, Tree::_value(x).first))
+          return x;
+        return _far(x) != NULL ? _first_in(_far(x), visited, pruned) : _end;
+      }
+      return _end;
+    }
+
+    /**
+     * Next match after x: in its far subtree, or at the first ancestor
+     * reached from its near side, or in that ancestor's far subtree.
+     */
+    Const_Base_ptr
+    _next(Const_Base_ptr x, std::size_t& visited, std::size_t& pruned) const {
+      if (_far(x) != NULL) {
+        Const_Base_ptr y = _first_in(_far(x), visited, pruned);
+        if (y != _end)
+          return y;
+      }
+      for (Const_Base_ptr p = x->_parent; p != _end; x = p, p = p->_parent) {
+        if (_near(p) != x)
+          continue;
+        ++visited;
+        // Ascending, the intervals left all start after this one.
+        if (Ascending && !_overlap.min_reaches(Tree::_value(p).first.first, _interval))
+          return _end;
+        if (_overlap(_interval, Tree::_value(p).first))
+          return p;
+        if (_far(p) != NULL) {
+          Const_Base_ptr y = _first_in(_far(p), visited, pruned);
+          if (y != _end)
+            return y;
+        }
+      }
+      return _end;
+    }
+
+    void
+    _report(std::size_t visited, std::size_t pruned) {
+      Tree::stats_type::traverse(visited, pruned, _node != _end ? 1 : 0);
+      this->_tally(visited, pruned, _node != _end ? 1 : 0);
+    }
+
+    Const_Base_ptr      _node;
+    const interval_type _interval;
+    Link_type           _end;
+    Interval_overlap<typename Tree::key_type,
+                     typename Tree::key_compare,
+                     typename Tree::endpoint_type,
+                     Query>                       _overlap;
+  };
+
+  template <typename Tree, bool A, typename Q1, typename Q2>
+  inline bool
+  operator==(const _interval_sorted_iterator<Tree,A,Q1>& x,
+             const _interval_const_iterator<Tree,Q2>& y)
+  { return x._node == y._node; }
+
+  template <typename Tree, bool A, typename Q1, typename Q2>
+  inline bool
+  operator!=(const _interval_sorted_iterator<Tree,A,Q1>& x,
+             const _interval_const_iterator<Tree,Q2>& y)
+  { return x._node != y._node; }
+
+  template <typename Tree, bool A, typename Q1, typename Q2>
+  inline bool
+  operator==(const _interval_sorted_iterator<Tree,A,Q1>& x,
+             const _interval_iterator<Tree,Q2>& y)
+  { return x._node == y._node; }
+
+  template <typename Tree, bool A, typename Q1, typename Q2>
+  inline bool
+  operator!=(const _interval_sorted_iterator<Tree,A,Q1>& x,
+             const _interval_iterator<Tree,Q2>& y)
+  { return x._node != y._node; }
+
+  /**
+   * Run of intervals overlapping a query, consecutive in low order:
+   * either a whole subtree proved to match, or a single interval.
+   * The augmentation of value() covers the run when whole().
+   */
+  template <typename Tree>
+  struct interval_span {
+    typedef typename Tree::const_ordered_iterator const_iterator;
+    typedef typename const_iterator::value_type   value_type;
+    typedef typename const_iterator::Link_type    Link_type;
+
+    interval_span(Link_type x, bool whole)
+    : _node(x), _whole(whole) {}
+
+    bool
+    whole() const
+    { return _whole; }
+
+    /**
+     * The value at the root of the run.
+     */
+    const value_type&
+    value() const
+    { return _node->_value; }
+
+    const_iterator
+    begin() const {
+      const _avl_tree_node_base* x = _node;
+      if (_whole)
+        while (x->_left != NULL)
+          x = x->_left;
+      return const_iterator(static_cast<Link_type>(x));
+    }
+
+    const_iterator
+    end() const {
+      const _avl_tree_node_base* x = _node;
+      if (_whole)
+        while (x->_right != NULL)
+          x = x->_right;
+      return ++const_iterator(static_cast<Link_type>(x));
+    }
+
+    /**
+     * Aggregate of the run, from the stored one of a whole subtree.
+     */
+    typename Tree::aggregate_type::value_type
+    aggregate() const {
+      if (_whole)
+        return _node->_value.second.aggregate;
+      return Tree::aggregate_type::value(_node->_value.first,
+                                         _node->_value.second.data);
+    }
+
+    Link_type _node;
+    bool      _whole;
+  };
+
+
+  /**
+   * Shape and pruning quality of an interval tree.
+   * Slack is max - low for each subtree: how far the max augmentation
+   * reaches past the lowest interval at its root. Large slacks let
+   * queries descend into subtrees holding no match.
+   * Visits are counted on stabbing queries sampled uniformly between
+   * the lowest and the highest ends of the tree.
+   */
+  struct interval_tree_diagnostics {
+    std::size_t              size;
+    int                      height;
+    std::vector<std::size_t> depth_histogram; // nodes per depth, root at 0
+    double                   average_node_depth; // finding a node compares one more key
+
+    double                   slack_mean;
+    double                   slack_p50;
+    double                   slack_p90;
+    double                   slack_p99;
+    double                   slack_max;
+
+    std::size_t              samples;
+    double                   visited_per_query;
+    double                   matched_per_query;
+    std::size_t              visited_max;
+  };
+
+  /**
+   * Augmented tree implementation.
+   * Cormen et al. (2001, Section 14.3: Interval trees, pp. 311–317)
+   *
+   * Use a simple self-balancing binary search tree, where the tree is ordered
+   * by the 'low' values of the intervals, and an extra annotation is added to
+   * every node recording the maximum high value of both its subtrees.
+   * It is simple to maintain this attribute in only O(h) steps during each
+   * addition or removal of a node, where h is the height of the node added or
+   * removed in the tree, by updating all ancestors of the node from the bottom
+   * up.
+   * Additionally, the tree rotations used during insertion and deletion
+   * require updating the max value of the affected nodes.
+   */
   template <typename Key,
             typename Data,
-            typename Compare = std::less<Key>,
-            typename Alloc = std::allocator<std::pair<
-              const std::pair<const Key,const Key>,
-              interval_tree_value<Key,Data> >
-                > >
-  class interval_tree : private avl_tree<std::pair<const Key,const Key>,
-                                         interval_tree_value<Key,Data>,
-                                         Interval_Compare<Key,Compare>,
-                                         Alloc,
-                                         Interval::rotation<interval_tree<Key,Data,Compare,Alloc> >,
-                                         Interval::updater<interval_tree<Key,Data,Compare,Alloc> > >
-  {
-    template <typename Self> friend struct Interval::rotation;
-    template <typename Self> friend struct Interval::updater;
-    template <typename Self> friend struct _interval_iterator;
-    template <typename Self> friend struct _interval_const_iterator;
+            typename Compare,
+            typename Alloc,
+            typename Endpoint,
+            typename Stats,
+            typename Aggregate,
+            typename Gap,
+            typename Sizes>
+  class interval_tree;
+
+  namespace Interval {
+    typedef _avl_tree_node_base*                  Node_ptr;
+
+    template <typename Tree> struct _join_cursor;
+
+    /**
+     * Weights summed by interval_tree::max_load.
+     */
+    template <typename Function, typename Value>
+    struct _weight_type {
+      typedef typename std::decay<decltype(
+        std::declval<Function&>()(std::declval<const Value&>()))>::type type;
+    };
+
+    struct _unit_weight {
+      template <typename Value>
+      std::size_t operator()(const Value&) const { return 1; }
+    };
+    template <typename TreeA, typename TreeB> struct _overlap_join;
+
+    /**
+     * Length from a to b, or Key() when b is not past a. Keys other
+     * than arithmetic ones have no gaps.
+     */
+    template <typename Key, typename Compare,
+              bool Arithmetic = std::is_arithmetic<Key>::value>
+    struct _gap {
+      static Key between(const Key& a, const Key& b)
+      { return Compare()(a, b) ? b - a : Key(); }
+
+      static Key larger(const Key& a, const Key& b)
+      { return std::max(a, b); }
+
+      /**
+       * Bound of the subtrees holding empty intervals, which no gap
+       * search skips.
+       */
+      static Key unknown() { return std::numeric_limits<Key>::max(); }
+    };
+
+    template <typename Key, typename Compare>
+    struct _gap<Key,Compare,false> {
+      static Key between(const Key&, const Key&) { return Key(); }
+      static Key larger(const Key&, const Key&) { return Key(); }
+      static Key unknown() { return Key(); }
+    };
+
+    /**
+     * Bound j of bins equal bins over [first,second]. Integral keys are
+     * divided before being multiplied, the remainder's share added apart,
+     * in the unsigned type so that even the span of the whole key range
+     * does not overflow.
+     */
+    template <typename Key, bool Integral = std::is_integral<Key>::value>
+    struct _bins {
+      static Key
+      bound(const Key& first, const Key& second, std::size_t j, std::size_t bins)
+      { return first + (second - first) * static_cast<Key>(j) / static_cast<Key>(bins); }
+    };
+
+    template <typename Key>
+    struct _bins<Key,true> {
+      static Key
+      bound(const Key& first, const Key& second, std::size_t j, std::size_t bins) {
+        typedef typename std::make_unsigned<Key>::type U;
+        const std::uintmax_t span =
+          static_cast<U>(static_cast<U>(second) - static_cast<U>(first));
+        const std::uintmax_t offset = span / bins * j + span % bins * j / bins;
+        return static_cast<Key>(static_cast<U>(static_cast<U>(first) + offset));
+      }
+    };
+
+    /**
+     * Whether [low,high] covers nothing: its ends are equal and one of
+     * them is open.
+     */
+    template <typename Endpoint, typename Key, typename Compare>
+    inline bool
+    _empty(const Key& low, const Key& high)
+    { return !(Endpoint::low_closed && Endpoint::high_closed) && !Compare()(low, high); }
+
+    /**
+     * Greater and lesser of two endpoints in the order of Compare, picking
+     * a on ties as std::max and std::min do, and whether they are
+     * equivalent.
+     */
+    template <typename Compare, typename Key>
+    inline const Key&
+    _max(const Key& a, const Key& b)
+    { return Compare()(a, b) ? b : a; }
+
+    template <typename Compare, typename Key>
+    inline const Key&
+    _min(const Key& a, const Key& b)
+    { return Compare()(b, a) ? b : a; }
+
+    template <typename Compare, typename Key>
+    inline bool
+    _same(const Key& a, const Key& b)
+    { return !Compare()(a, b) && !Compare()(b, a); }
+
+    template <typename Tree>
+    struct rotation {
+      static
+      void
+      left(Node_ptr x,
+           Node_ptr& root) {
+        AVL::rotation::left(x, root);
+        Tree::stats_type::rotate();
+        _update_min_max(x);
+        _update_gap(x);
+        _update_gap(x->_parent);
+        _update_aggregate(x);
+        _update_aggregate(x->_parent);
+      }
+
+      static
+      void
+      right(Node_ptr x,
+            Node_ptr& root) {
+        AVL::rotation::right(x, root);
+        Tree::stats_type::rotate();
+        _update_min_max(x);
+        _update_gap(x);
+        _update_gap(x->_parent);
+        _update_aggregate(x);
+        _update_aggregate(x->_parent);
+      }
+
+      /**
+       * Recompute all the augmentation of x from its children's.
+       */
+      static
+      void
+      _recompute(Node_ptr x) {
+        _recompute_min_max(static_cast<typename Tree::Link_type>(x));
+        _update_gap(x);
+        _update_aggregate(x);
+      }
+
+      /**
+       * Recompute the gap bound of x from its children's, when gaps are
+       * tracked. Returns whether the bound changed.
+       */
+      static
+      bool
+      _update_gap(Node_ptr x) {
+        return _update_gap(static_cast<typename Tree::Link_type>(x),
+          std::integral_constant<bool, Tree::_tracks_gaps>());
+      }
+
+      /**
+       * Recombine the aggregate of x from its children's, in low order.
+       */
+      static
+      void
+      _update_aggregate(Node_ptr x) {
+        _update_aggregate(static_cast<typename Tree::Link_type>(x),
+          std::is_void<typename Tree::aggregate_type::value_type>());
+      }
+
+    private:
+      static
+      bool
+      _update_gap(typename Tree::Link_type, std::false_type)
+      { return false; }
+
+      /**
+       * Gaps of the right subtree are not checked against long intervals
+       * on the left, which keeps it O(1) but makes it an upper bound.
+       * Empty intervals still count in max and min, so their subtrees get
+       * no bound.
+       */
+      static
+      bool
+      _update_gap(typename Tree::Link_type node, std::true_type) {
+        typedef _gap<typename Tree::key_type,
+                     typename Tree::key_compare> gap;
+        typename Tree::key_type& bound = node->_value.second.gap;
+        const typename Tree::key_type old = bound;
+        typename Tree::key_type reach = node->_value.first.second;
+        if (_empty<typename Tree::endpoint_type,
+                   typename Tree::key_type,
+                   typename Tree::key_compare>(node->_value.first.first, reach)) {
+          bound = gap::unknown();
+          return !_same<typename Tree::key_compare>(old, bound);
+        }
+        bound = typename Tree::key_type();
+        if (node->_left != NULL) {
+          const typename Tree::mapped_type& l = Tree::_left(node)->_value.second;
+          bound = gap::larger(l.gap, gap::between(l.max, node->_value.first.first));
+          reach = _max<typename Tree::key_compare>(reach, l.max);
+        }
+        if (node->_right != NULL) {
+          const typename Tree::mapped_type& r = Tree::_right(node)->_value.second;
+          bound = gap::larger(bound, gap::larger(r.gap, gap::between(reach, r.min)));
+        }
+        return !_same<typename Tree::key_compare>(old, bound);
+      }
+
+      static
+      void
+      _update_aggregate(typename Tree::Link_type, std::true_type) {}
+
+      static
+      void
+      _update_aggregate(typename Tree::Link_type x, std::false_type) {
+        typedef typename Tree::aggregate_type A;
+        typename A::value_type a = A::value(x->_value.first, x->_value.second.data);
+        if (x->_left != NULL)
+          a = A::combine(Tree::_left(x)->_value.second.aggregate, a);
+        if (x->_right != NULL)
+          a = A::combine(a, Tree::_right(x)->_value.second.aggregate);
+        x->_value.second.aggregate = a;
+      }
+
+      static
+      void
+      _update_min_max(Node_ptr x) {
+        typename Tree::Link_type node = static_cast<typename Tree::Link_type>(x);
+        Tree::_parent(node)->_value.second.max = node->_value.second.max;
+        Tree::_parent(node)->_value.second.min = node->_value.second.min;
+        Tree::_parent(node)->_value.second.min_high = node->_value.second.min_high;
+        _recompute_min_max(node);
+      }
+
+      static
+      void
+      _recompute_min_max(typename Tree::Link_type node) {
+        node->_value.second.max = node->_value.first.second;
+        node->_value.second.min = node->_value.first.first;
+        node->_value.second.min_high = node->_value.first.second;
+        typename Tree::key_type& max_subtree = node->_value.second.max;
+        typename Tree::key_type& min_subtree = node->_value.second.min;
+        typename Tree::key_type& min_high = node->_value.second.min_high;
+        typedef typename Tree::key_compare C;
+        if (node->_left != NULL) {
+          const typename Tree::mapped_type& l = Tree::_left(node)->_value.second;
+          max_subtree = _max<C>(max_subtree, l.max);
+          min_subtree = _min<C>(min_subtree, l.min);
+          min_high = _min<C>(min_high, l.min_high);
+        }
+        if (node->_right != NULL) {
+          const typename Tree::mapped_type& r = Tree::_right(node)->_value.second;
+          max_subtree = _max<C>(max_subtree, r.max);
+          min_subtree = _min<C>(min_subtree, r.min);
+          min_high = _min<C>(min_high, r.min_high);
+        }
+      }
+    };
+
+    template <typename Tree>
+    struct updater {
+      static
+      void
+      update(Node_ptr x, Node_ptr& unbalanced, Node_ptr& root) {
+        rotation<Tree>::_recompute(x); // the new leaf's own augmentation
+        if (x == root) // the header above has no augmentation
+          return;
+        // Update balances bottom-up.
+        bool unbalance_switch = false;
+        typename Tree::Link_type leaf = static_cast<typename Tree::Link_type>(x);
+        for (;;) {
+          typename Tree::Link_type p = static_cast<typename Tree::Link_type>(leaf->_parent);
+          if (!unbalance_switch) {
+            if (p->_left == leaf)
+              p->_balance--;
+            else
+              p->_balance++;
+          }
+          Tree::stats_type::update();
+          typename Tree::Base_type::mapped_type& v = p->_value.second;
+          const typename Tree::key_type max = v.max, min = v.min;
+          const typename Tree::key_type min_high = v.min_high;
+          typedef typename Tree::key_compare C;
+          v.max = _max<C>(leaf->_value.second.max, v.max);
+          v.min = _min<C>(leaf->_value.second.min, v.min);
+          v.min_high = _min<C>(leaf->_value.second.min_high, v.min_high);
+          const bool gap_changed = rotation<Tree>::_update_gap(p);
+          rotation<Tree>::_update_aggregate(p);
+          if (p == root) // up to the root
+            break;
+          // Above the balance changes, ancestors only depend on p.
+          if (unbalance_switch && _same<C>(max, v.max) && _same<C>(min, v.min)
+              && _same<C>(min_high, v.min_high) && !gap_changed
+              && std::is_void<typename Tree::aggregate_type::value_type>::value)
+            break;
+          if (p == unbalanced)
+            unbalance_switch = true;
+          leaf = p;
+        }
+      }
+
+      /**
+       * Recompute the augmentation from x up to root, after an erasure
+       * below x.
+       */
+      static
+      void
+      repair(Node_ptr x, Node_ptr root) {
+        for (;;) {
+          Tree::stats_type::update();
+          rotation<Tree>::_recompute(x);
+          if (x == root)
+            break;
+          x = x->_parent;
+        }
+      }
+    };
+  }
+
+  template <typename Key,
+            typename Data,
+            typename Compare = std::less<Key>,
+            typename Alloc = std::allocator<std::pair<
+              const std::pair<const Key,const Key>,
+              interval_tree_value<Key,Data> >
+                >,
+            typename Endpoint = Interval::open,
+            typename Stats = Interval::no_stats,
+            typename Aggregate = Interval::no_aggregate,
+            typename Gap = Interval::no_gaps,
+            typename Sizes = AVL::unsized>
+  class interval_tree : private avl_tree<std::pair<const Key,const Key>,
+                                         interval_tree_value<Key,Data,typename Aggregate::value_type,
+                                                             typename Gap::template bound<Key>::type>,
+                                         Interval_Compare<Key,Compare>,
+                                         Interval::_stats_allocator<Alloc,Stats>,
+                                         Interval::rotation<interval_tree<Key,Data,Compare,Alloc,Endpoint,Stats,Aggregate,Gap,Sizes> >,
+                                         Interval::updater<interval_tree<Key,Data,Compare,Alloc,Endpoint,Stats,Aggregate,Gap,Sizes> >,
+                                         Sizes>
+  {
+    template <typename Self> friend struct Interval::rotation;
+    template <typename Self> friend struct Interval::updater;
+    template <typename Self, typename Query> friend struct _interval_iterator;
+    template <typename Self, typename Query, typename S> friend struct _interval_const_iterator;
+    template <typename Self, bool A, typename Query> friend struct _interval_sorted_iterator;
+    template <typename Self> friend struct Interval::_join_cursor;
+    template <typename A, typename B> friend struct Interval::_overlap_join;
+
+    typedef avl_tree<std::pair<const Key,const Key>,
+                     interval_tree_value<Key,Data,typename Aggregate::value_type,
+                                         typename Gap::template bound<Key>::type>,
+                     Interval_Compare<Key,Compare>,
+                     Interval::_stats_allocator<Alloc,Stats>,
+                     Interval::rotation<interval_tree<Key,Data,Compare,Alloc,Endpoint,Stats,Aggregate,Gap,Sizes> >,
+                     Interval::updater<interval_tree<Key,Data,Compare,Alloc,Endpoint,Stats,Aggregate,Gap,Sizes> >,
+                     Sizes>
+                                                    Base_type;
+    typedef interval_tree<Key,Data,Compare,Alloc,Endpoint,Stats,Aggregate,Gap,Sizes> Self;
+    typedef typename Base_type::Base_ptr            Base_ptr;
+    typedef typename Base_type::Const_Base_ptr      Const_Base_ptr;
+    typedef typename Base_type::Link_type           Link_type;
+    typedef typename Base_type::Const_Link_type     Const_Link_type;
+
+    static const bool _tracks_gaps =
+      !std::is_void<typename Gap::template bound<Key>::type>::value;
+
+  public:
+    typedef Key                                 key_type;
+    typedef std::pair<const Key,const Key>      interval_type;
+    typedef std::pair<const interval_type,Data> value_type;
+    typedef Compare                             key_compare;
+    typedef Interval_Compare<Key,Compare>       interval_compare;
+    typedef Endpoint                            endpoint_type;
+    typedef Stats                               stats_type;
+    typedef Aggregate                           aggregate_type;
+    typedef Gap                                 gap_type;
+    typedef Alloc                               allocator_type;
+    typedef typename Base_type::size_type       size_type;
+    typedef _interval_iterator<Self>            iterator;
+    typedef _interval_const_iterator<Self>      const_iterator;
+    typedef _interval_const_iterator<Self,typename Endpoint::point_type>
+                                                point_const_iterator;
+    typedef _interval_sorted_iterator<Self,true>  ascending_const_iterator;
+    typedef _interval_sorted_iterator<Self,false> descending_const_iterator;
+    typedef interval_span<Self>                   span_type;
+    typedef typename Base_type::iterator        ordered_iterator;
+    typedef typename Base_type::const_iterator  const_ordered_iterator;
+    typedef typename Base_type::reverse_iterator reverse_ordered_iterator;
+    typedef typename Base_type::const_reverse_iterator
+                                                const_reverse_ordered_iterator;
+
+  public:
+    using Base_type::_header;
+    using Base_type::size;
+    using Base_type::empty;
+
+    interval_tree()
+    : _end(&_header, _dummy_interval, &_header) {}
+
+    explicit interval_tree(const Alloc& a)
+    : Base_type(a), _end(&_header, _dummy_interval, &_header) {}
+
+    interval_tree(const interval_tree<Key,Data,Compare,Alloc,Endpoint,Stats,Aggregate,Gap,Sizes>& o)
+    : Base_type(o), _end(&_header, _dummy_interval, &_header) {}
+
+    allocator_type
+    get_allocator() const
+    { return Base_type::get_allocator(); }
+
+    /** 
+     * Find all intervals containing the key k.
+     */
+    point_const_iterator
+    equal_range(const key_type& k) const {
+      interval_type i = std::make_pair(k, k);
+      Base_ptr root = this->_header._parent;
+      Stats::query();
+      return point_const_iterator(static_cast<Link_type>(root), i, &this->_header);
+    }
+
+    /**
+     * Find all intervals overlapping interval i.
+     */
+    const_iterator
+    equal_range(const interval_type& i) const {
+      Base_ptr root = this->_header._parent;
+      Stats::query();
+      return const_iterator(static_cast<Link_type>(root), i, &this->_header);
+    }
+
+    /**
+     * Same as equal_range(i), the intervals coming by increasing low end.
+     * O(log n) to the first, then amortized O(1) per interval when the
+     * max augmentation prunes well, like equal_range.
+     */
+    ascending_const_iterator
+    equal_range_ascending(const interval_type& i) const {
+      Stats::query();
+      return ascending_const_iterator(this->_begin(), i,
+                                      static_cast<Const_Link_type>(&this->_header));
+    }
+
+    /**
+     * Same as equal_range(i), the intervals coming by decreasing low end.
+     */
+    descending_const_iterator
+    equal_range_descending(const interval_type& i) const {
+      Stats::query();
+      return descending_const_iterator(this->_begin(), i,
+                                       static_cast<Const_Link_type>(&this->_header));
+    }
+
+    /**
+     * Resume equal_range_ascending(i) after the interval of low end
+     * cursor, the last one returned. O(log n) to the next interval, with
+     * nothing skipped one by one. The cursor is only a key, so it stays
+     * valid across inserts and erasures, even of that interval.
+     */
+    ascending_const_iterator
+    equal_range_from(const interval_type& i, const Key& cursor) const {
+      Stats::query();
+      return ascending_const_iterator(this->_begin(), i,
+                                      static_cast<Const_Link_type>(&this->_header),
+                                      cursor);
+    }
+
+    /**
+     * Resume equal_range_descending(i) before the interval of low end
+     * cursor.
+     */
+    descending_const_iterator
+    equal_range_descending_from(const interval_type& i, const Key& cursor) const {
+      Stats::query();
+      return descending_const_iterator(this->_begin(), i,
+                                       static_cast<Const_Link_type>(&this->_header),
+                                       cursor);
+    }
+
+    /**
+     * Returns a pair, with its member pair::first set to an iterator pointing
+     * to either the newly inserted interval or to the element that already had
+     * its same interval in the map.
+     * The pair::second element in the pair is set to true if a new element was
+     * inserted or false if an element with the same key existed.
+     */
+    std::pair<iterator,bool>
+    insert(const value_type& x) {
+      return emplace(x.first.first, x.first.second, x.second);
+    }
+
+    std::pair<iterator,bool>
+    insert(value_type&& x) {
+      return emplace(x.first.first, x.first.second, std::move(x.second));
+    }
+
+    /**
+     * Insert the interval [low,high], its data being constructed in the
+     * node from args, and only when low is not already present.
+     */
+    template <typename... Args>
+    std::pair<iterator,bool>
+    emplace(const Key& low, const Key& high, Args&&... args) {
+      return try_emplace(interval_type(low, high), std::forward<Args>(args)...);
+    }
+
+    /**
+     * Same as emplace, for an interval given whole: args are left untouched
+     * when the low end of i is already present.
+     */
+    template <typename... Args>
+    std::pair<iterator,bool>
+    try_emplace(const interval_type& i, Args&&... args) {
+      std::pair<typename Base_type::iterator,bool> r =
+        Base_type::_emplace_unique(i, std::piecewise_construct,
+                                   std::forward_as_tuple(i),
+                                   std::forward_as_tuple(std::piecewise_construct,
+                                                         std::forward<Args>(args)...));
+      return std::make_pair(_at(r.first._node), r.second);
+    }
+
+    /**
+     * Insert i with data d or, when the low end of i is already present,
+     * make that interval i and assign d to it. One descent; the
+     * augmentation above the node is then fixed in O(log n) if its high
+     * end or, with an aggregate policy, its data changed.
+     */
+    template <typename M>
+    std::pair<iterator,bool>
+    insert_or_assign(const interval_type& i, M&& d) {
+      std::pair<typename Base_type::iterator,bool> r =
+        Base_type::_emplace_unique(i, std::piecewise_construct,
+                                   std::forward_as_tuple(i),
+                                   std::forward_as_tuple(std::piecewise_construct,
+                                                         std::forward<M>(d)));
+      if (r.second)
+        return std::make_pair(_at(r.first._node), true);
+      Compare compare;
+      Link_type x = static_cast<Link_type>(r.first._node);
+      if (compare(x->_value.first.second, i.second)
+          || compare(i.second, x->_value.first.second)) {
+        Link_type y = this->_create_node(std::piecewise_construct,
+                                         std::forward_as_tuple(i),
+                                         std::forward_as_tuple(std::piecewise_construct,
+                                                               std::forward<M>(d)));
+        this->_replace_node(x, y);
+        x = y;
+      } else {
+        x->_value.second.data = std::forward<M>(d);
+        if (std::is_void<typename Aggregate::value_type>::value)
+          return std::make_pair(_at(x), false);
+      }
+      Interval::updater<Self>::repair(x, this->_header._parent);
+      return std::make_pair(_at(x), false);
+    }
+
+    /**
+     * The interval i, both ends matching, or end(). O(log n).
+     */
+    iterator
+    find(const interval_type& i) {
+      return _at(const_cast<Link_type>(_find(i)));
+    }
+
+    const_iterator
+    find(const interval_type& i) const {
+      return const_iterator(_find(i), static_cast<Const_Link_type>(&this->_header));
+    }
+
+    /**
+     * Insert x next to hint when its low end belongs there, without
+     * descending from the root; end() hints an append after the interval
+     * of greatest low end, as in nearly sorted streams. Falls back to
+     * insert(x) otherwise.
+     */
+    iterator
+    insert(const const_iterator& hint, const value_type& x) {
+      return _at(_insert_hint(const_cast<Base_ptr>(hint._node), x)._node);
+    }
+
+    ordered_iterator
+    insert(const const_ordered_iterator& hint, const value_type& x) {
+      return _insert_hint(const_cast<Base_ptr>(hint._node), x);
+    }
+
+    /**
+     * Insert the intervals of [first,last), sorted by low end, in
+     * O(m log(n/m + 1)): they are linked into a balanced tree in O(m),
+     * then merged in on up to threads threads as merge does. Intervals
+     * whose low end is already present, or given earlier, are dropped,
+     * as insert would.
+     */
+    template <typename InputIterator>
+    void
+    insert_batch(InputIterator first, InputIterator last, unsigned threads = 1) {
+      typename Base_type::_chain_type c(*this);
+      for (; first != last; ++first) {
+        const value_type& v = *first;
+        this->_chain(c, threads, v.first, std::piecewise_construct,
+                     std::forward_as_tuple(v.first),
+                     std::forward_as_tuple(std::piecewise_construct, v.second));
+      }
+      this->_insert_batch(c, threads);
+    }
+
+    /**
+     * Erase the intervals of [first,last), sorted by low end, matching
+     * both ends as erase does. O(m log(n/m + 1)) on up to threads threads
+     * as merge does. Returns the number of intervals erased.
+     */
+    template <typename RandomAccessIterator>
+    size_type
+    erase_batch(RandomAccessIterator first, RandomAccessIterator last,
+                unsigned threads = 1) {
+      return this->_erase_batch(first, last, threads, _same_high());
+    }
+
+    /**
+     * Erase the interval i, if stored. Returns the number of intervals
+     * erased. O(log n).
+     */
+    size_type
+    erase(const interval_type& i) {
+      Const_Link_type x = _find(i);
+      if (x == &this->_header)
+        return 0;
+      this->_erase_node(const_cast<Link_type>(x));
+      return 1;
+    }
+
+    /**
+     * Erase the intervals ending before t, found through min_high in
+     * O(log n) each. When more than about n / log n of them expire, the
+     * survivors are instead relinked into a balanced tree in O(n), without
+     * allocating. Returns the number of intervals erased.
+     */
+    size_type
+    expire_before(const Key& t) {
+      size_type depth = 1;
+      const size_type n = this->size();
+      for (size_type i = n; i > 1; i >>= 1)
+        ++depth;
+      const size_type limit = n / depth;
+
+      std::vector<Link_type> expired;
+      Link_type stack[STACK_SIZE];
+      int sp = 0;
+      if (this->_begin() != NULL)
+        stack[sp++] = this->_begin();
+      while (sp > 0 && expired.size() <= limit) {
+        Link_type x = stack[--sp];
+        if (!_ends_before(x->_value.second.min_high, t))
+          continue;
+        if (_ends_before(x->_value.first.second, t))
+          expired.push_back(x);
+        if (x->_right != NULL)
+          stack[sp++] = Base_type::_right(x);
+        if (x->_left != NULL)
+          stack[sp++] = Base_type::_left(x);
+      }
+      if (expired.size() > limit)
+        return _rebuild_without(t);
+      for (std::size_t i = 0; i < expired.size(); ++i)
+        Base_type::_erase_node(expired[i]);
+      return expired.size();
+    }
+
+    /**
+     * Move the intervals whose low ends are not before k to right, which
+     * must be empty, the augmentation being repaired along the paths
+     * where the pieces are joined back. O(log n) when Sizes is AVL::sized,
+     * otherwise the smaller piece is counted as avl_tree::split does.
+     */
+    void
+    split(const Key& k, interval_tree& right) {
+      Base_type::split(interval_type(k, k), right);
+    }
+
+    /**
+     * Move the intervals of right, whose low ends must all come after
+     * those of this tree, to this tree. O(log n), the augmentation being
+     * repaired along the spine where right is attached.
+     */
+    void
+    join(interval_tree& right) {
+      Base_type::join(right);
+    }
+
+    /**
+     * Move the intervals of other to this tree, dropping those whose low
+     * end is already here; the allocators must compare equal. Nodes are
+     * relinked, not copied: O(m log(n/m + 1)) for m the size of the
+     * smaller tree, on up to threads threads for large trees. Nodes are
+     * only allocated and freed on the calling thread, but the others call
+     * Stats::rotate and Stats::update, which must then be safe to call at
+     * once as counting_stats is.
+     */
+    void
+    merge(interval_tree&& other, unsigned threads = 1) {
+      Base_type::merge(other, threads);
+    }
+
+    iterator
+    end() {
+      return _end;
+    }
+
+    const_iterator
+    end() const {
+      return _end;
+    }
+
+    /**
+     * Bidirectional iteration over all the intervals by increasing low
+     * end, O(1) amortized per step, following the parent links rather
+     * than a query stack.
+     */
+    ordered_iterator
+    ordered_begin()
+    { return Base_type::begin(); }
+
+    const_ordered_iterator
+    ordered_begin() const
+    { return Base_type::begin(); }
+
+    ordered_iterator
+    ordered_end()
+    { return Base_type::end(); }
+
+    const_ordered_iterator
+    ordered_end() const
+    { return Base_type::end(); }
+
+    reverse_ordered_iterator
+    ordered_rbegin()
+    { return Base_type::rbegin(); }
+
+    const_reverse_ordered_iterator
+    ordered_rbegin() const
+    { return Base_type::rbegin(); }
+
+    reverse_ordered_iterator
+    ordered_rend()
+    { return Base_type::rend(); }
+
+    const_reverse_ordered_iterator
+    ordered_rend() const
+    { return Base_type::rend(); }
+
+    /**
+     * First interval, in low order, whose low end is not before k, or
+     * ordered_end(). O(log n).
+     */
+    ordered_iterator
+    lower_bound(const Key& k)
+    { return Base_type::lower_bound(interval_type(k, k)); }
+
+    const_ordered_iterator
+    lower_bound(const Key& k) const
+    { return Base_type::lower_bound(interval_type(k, k)); }
+
+    /**
+     * First interval, in low order, whose low end is after k, or
+     * ordered_end(). O(log n).
+     */
+    ordered_iterator
+    upper_bound(const Key& k)
+    { return Base_type::upper_bound(interval_type(k, k)); }
+
+    const_ordered_iterator
+    upper_bound(const Key& k) const
+    { return Base_type::upper_bound(interval_type(k, k)); }
+
+    /**
+     * Bytes held by the tree. Payload includes the intervals and the max,
+     * min and min_high augmentation, with the gap bound under
+     * Interval::track_gaps, fixed bytes the header, the end() iterator
+     * with its stack and the dummy interval.
+     */
+    tree_memory_usage
+    memory_usage() const {
+      tree_memory_usage m = Base_type::memory_usage();
+      m.augmentation_bytes = m.nodes
+        * (sizeof(typename Base_type::mapped_type) - sizeof(Data));
+      m.end_iterator_bytes = sizeof(_end);
+      m.dummy_interval_bytes = sizeof(_dummy_interval);
+      m.fixed_bytes = sizeof(*this);
+      return m;
+    }
+
+    /**
+     * Counters of the Stats policy, shared by all the trees using it.
+     * Pruning efficiency is visited / matched.
+     */
+    static Interval::stats_counters
+    stats() {
+      return Stats::snapshot();
+    }
+
+    static void
+    reset_stats() {
+      Stats::reset();
+    }
+
+    /**
+     * Call f(v, id) for each value v in order of low ends, where id numbers
+     * from 0 the clusters of intervals overlapping each other, directly or
+     * through other intervals. O(n), no query.
+     */
+    template <typename Function>
+    Function
+    clusters(Function f) const {
+      Compare compare;
+      Key high = Key();
+      std::size_t id = 0;
+      for (Const_Base_ptr x = this->_header._left; x != &this->_header;
+           x = _avl_tree_increment(x)) {
+        const typename Base_type::value_type& v =
+          static_cast<Const_Link_type>(x)->_value;
+        if (x == this->_header._left)
+          high = v.first.second;
+        else if (_joins(v.first.first, high)) {
+          if (compare(high, v.first.second))
+            high = v.first.second;
+        } else {
+          high = v.first.second;
+          ++id;
+        }
+        f(v, id);
+      }
+      return f;
+    }
+
+    /**
+     * Write the spans of the clusters, by increasing low ends, as
+     * interval_type values. O(n), no query.
+     */
+    template <typename OutputIterator>
+    OutputIterator
+    merge_overlapping(OutputIterator out) const {
+      Const_Base_ptr x = this->_header._left;
+      if (x == &this->_header)
+        return out;
+      Compare compare;
+      Key low = static_cast<Const_Link_type>(x)->_value.first.first;
+      Key high = static_cast<Const_Link_type>(x)->_value.first.second;
+      for (x = _avl_tree_increment(x); x != &this->_header;
+           x = _avl_tree_increment(x)) {
+        const interval_type& i = static_cast<Const_Link_type>(x)->_value.first;
+        if (_joins(i.first, high)) {
+          if (compare(high, i.second))
+            high = i.second;
+        } else {
+          *out++ = interval_type(low, high);
+          low = i.first;
+          high = i.second;
+        }
+      }
+      *out++ = interval_type(low, high);
+      return out;
+    }
+
+    /**
+     * Maximal number of intervals sharing a point of the window w, with
+     * the point where it is first reached: either w.first or the low end
+     * of an interval (or just after it for intervals or windows open
+     * there). Returns (0, w.first) when nothing overlaps w.
+     * O(log n + k log k) for k intervals overlapping w: they are swept in
+     * low order, no augmentation bounding the depth being kept.
+     */
+    std::pair<std::size_t,Key>
+    max_depth(const interval_type& w) const {
+      return _peak<std::size_t>(w, Interval::_unit_weight());
+    }
+
+    /**
+     * Same as max_depth, summing weight(v) over the values v of the
+     * intervals sharing the point rather than counting them, in the same
+     * O(log n + k log k).
+     */
+    template <typename Function>
+    std::pair<typename Interval::_weight_type<Function,
+                typename Base_type::value_type>::type,Key>
+    max_load(const interval_type& w, Function weight) const {
+      return _peak<typename Interval::_weight_type<Function,
+        typename Base_type::value_type>::type>(w, weight);
+    }
+
+    /**
+     * Length of the union of the intervals, clipped to the window w.
+     * Requires Key to support + and -. O(log n + k) for the k intervals
+     * overlapping w that reach past the ones before them: there is no
+     * union length kept per subtree, so a window densely covered by short
+     * intervals visits each of them.
+     */
+    Key
+    covered_length(const interval_type& w) const {
+      _cover_sweep sweep(w);
+      if (Compare()(w.first, w.second))
+        _overlaps_in_order<Endpoint>(w, sweep);
+      return sweep._length;
+    }
+
+    /**
+     * Split the window w into bins of equal width and write to out, for
+     * each bin, its depth: the number of intervals covering part of it.
+     * Returns the end of the output. O(log n + k log bins + bins) for k
+     * intervals overlapping w.
+     */
+    template <typename OutputIterator>
+    OutputIterator
+    coverage_histogram(const interval_type& w, std::size_t bins,
+                       OutputIterator out) const {
+      if (bins == 0)
+        return out;
+      _bin_sweep sweep(w, bins);
+      if (Compare()(w.first, w.second))
+        _overlaps_in_order<Endpoint>(w, sweep);
+      long long depth = 0;
+      for (std::size_t j = 0; j < bins; ++j) {
+        depth += sweep._touching[j];
+        *out++ = static_cast<std::size_t>(depth);
+      }
+      return out;
+    }
+
+    /**
+     * Same bins as coverage_histogram, writing for each the summed
+     * length of the intervals within it rather than their number: the
+     * bin's mean depth times its width.
+     */
+    template <typename OutputIterator>
+    OutputIterator
+    coverage_length_histogram(const interval_type& w, std::size_t bins,
+                              OutputIterator out) const {
+      if (bins == 0)
+        return out;
+      _bin_sweep sweep(w, bins);
+      if (Compare()(w.first, w.second))
+        _overlaps_in_order<Endpoint>(w, sweep);
+      long long spanning = 0;
+      for (std::size_t j = 0; j < bins; ++j) {
+        spanning += sweep._spanning[j];
+        *out++ = sweep._covered[j] + static_cast<Key>(spanning)
+          * (sweep._bounds[j + 1] - sweep._bounds[j]);
+      }
+      return out;
+    }
+
+    /**
+     * Start of the first gap of at least length between the intervals,
+     * at or after from: from itself, the high end of an interval or the
+     * reach of the last one. Empty intervals cover nothing and split no
+     * gap. Requires an arithmetic Key.
+     * Under Interval::track_gaps, subtrees are skipped on their gap
+     * bound, which is only an upper bound: long intervals covering
+     * recorded gaps, or empty intervals, make the search descend further.
+     * It is O(log n) on disjoint or short intervals, with no such
+     * guarantee in general. Otherwise only the subtrees ending before
+     * from are skipped, and it is O(n) in the worst case.
+     */
+    Key
+    find_gap(const Key& from, const Key& length) const {
+      Key reach = from;
+      _first_fit fit(length);
+      _walk_gaps(reach, fit);
+      return reach;
+    }
+
+    /**
+     * Start of the first gap of at least length within the window w,
+     * and whether there is one.
+     */
+    std::pair<Key,bool>
+    find_gap(const interval_type& w, const Key& length) const {
+      Key start = find_gap(w.first, length);
+      return std::make_pair(start, !Compare()(w.second, start + length));
+    }
+
+    /**
+     * Write the maximal sub-intervals of the window w covered by no
+     * interval to out, in order. Returns the end of the output.
+     */
+    template <typename OutputIterator>
+    OutputIterator
+    gaps(const interval_type& w, OutputIterator out) const {
+      Compare compare;
+      Key reach = w.first;
+      _gap_writer<OutputIterator> writer(w.second, out);
+      if (!_walk_gaps(reach, writer) && compare(reach, w.second))
+        *writer._out++ = interval_type(reach, w.second);
+      return writer._out;
+    }
+
+    /**
+     * Call f(v) for each value v whose interval contains i, in order of
+     * low ends. Only the low ends up to i.first are scanned, skipping the
+     * subtrees whose max stops before i.second.
+     */
+    template <typename Function>
+    Function
+    containing(const interval_type& i, Function f) const {
+      Compare compare;
+      Const_Link_type stack[STACK_SIZE];
+      int sp = 0;
+      Const_Link_type x = this->_begin();
+      for (;;) {
+        for (; x != NULL && !compare(x->_value.second.max, i.second);
+             x = Base_type::_left(x))
+          stack[sp++] = x;
+        if (sp == 0)
+          return f;
+        x = stack[--sp];
+        if (compare(i.first, x->_value.first.first))
+          return f;
+        if (!compare(x->_value.first.second, i.second))
+          f(x->_value);
+        x = Base_type::_right(x);
+      }
+    }
+
+    /**
+     * Call f(v) for each value v whose interval lies within i, in order of
+     * low ends. Scans the low ends from i.first until they pass i.second,
+     * skipping the subtrees whose min_high is past i.second: O((1 + k)
+     * log n) for k intervals reported.
+     */
+    template <typename Function>
+    Function
+    contained_in(const interval_type& i, Function f) const {
+      Compare compare;
+      Const_Link_type stack[STACK_SIZE];
+      int sp = 0;
+      Const_Link_type x = this->_begin();
+      while (x != NULL && !compare(i.second, x->_value.second.min_high)) {
+        if (compare(x->_value.first.first, i.first)) {
+          x = Base_type::_right(x);
+        } else {
+          stack[sp++] = x;
+          x = Base_type::_left(x);
+        }
+      }
+      while (sp > 0) {
+        x = stack[--sp];
+        if (compare(i.second, x->_value.first.first))
+          return f;
+        if (!compare(i.second, x->_value.first.second))
+          f(x->_value);
+        for (x = Base_type::_right(x);
+             x != NULL && !compare(i.second, x->_value.second.min_high);
+             x = Base_type::_left(x))
+          stack[sp++] = x;
+      }
+      return f;
+    }
+
+    /**
+     * The interval starting first after k, without containing it, or NULL.
+     * O(log n).
+     */
+    const typename const_iterator::value_type*
+    next_after(const Key& k) const {
+      Const_Link_type next = NULL;
+      for (Const_Link_type x = this->_begin(); x != NULL; ) {
+        if (_starts_after(k, x->_value.first.first)) {
+          next = x;
+          x = Base_type::_left(x);
+        } else {
+          x = Base_type::_right(x);
+        }
+      }
+      return next == NULL ? NULL : &next->_value;
+    }
+
+    /**
+     * The interval ending last before k, without containing it, or NULL.
+     * Subtrees ending before k are compared on their max; the others
+     * hold an interval reaching k and are opened. O(log n) when k stabs
+     * no interval.
+     */
+    const typename const_iterator::value_type*
+    prev_before(const Key& k) const {
+      _last_before last;
+      _before_roots(k, last);
+      if (last._node == NULL)
+        return NULL;
+      Compare compare;
+      Const_Link_type x = last._node;
+      while (last._whole && compare(x->_value.first.second, x->_value.second.max)) {
+        Const_Link_type l = Base_type::_left(x);
+        x = l != NULL && !compare(l->_value.second.max, x->_value.second.max)
+          ? l : Base_type::_right(x);
+      }
+      return &x->_value;
+    }
+
+    /**
+     * An interval containing k if any, otherwise the closest of
+     * prev_before(k) and next_after(k), or NULL for an empty tree.
+     * Requires Key to support -.
+     */
+    const typename const_iterator::value_type*
+    nearest(const Key& k) const {
+      point_const_iterator i = equal_range(k);
+      if (i != end())
+        return &*i;
+      const typename const_iterator::value_type* prev = prev_before(k);
+      const typename const_iterator::value_type* next = next_after(k);
+      if (prev == NULL || next == NULL)
+        return prev == NULL ? next : prev;
+      return next->first.first - k < k - prev->first.second ? next : prev;
+    }
+
+    /**
+     * Call f(v) for the n values whose intervals are closest to k, by
+     * increasing distance: those containing k first, then the intervals
+     * after k in low order merged with those before k by decreasing high
+     * ends, drawn from a heap of the subtrees ending before k.
+     * O(log n + n log(n + log n)). Requires Key to support -.
+     */
+    template <typename Function>
+    Function
+    k_nearest(const Key& k, std::size_t n, Function f) const {
+      for (point_const_iterator i = equal_range(k); n > 0 && i != end(); ++i) {
+        f(*i);
+        --n;
+      }
+      if (n == 0)
+        return f;
+
+      _before_heap before;
+      _before_roots(k, before);
+      std::vector<typename _before_heap::entry>& heap = before._heap;
+      typename _before_heap::later later;
+      std::make_heap(heap.begin(), heap.end(), later);
+
+      Const_Link_type stack[STACK_SIZE];
+      int sp = 0;
+      for (Const_Link_type x = this->_begin(); x != NULL; ) {
+        if (_starts_after(k, x->_value.first.first)) {
+          stack[sp++] = x;
+          x = Base_type::_left(x);
+        } else {
+          x = Base_type::_right(x);
+        }
+      }
+
+      while (n > 0 && (sp > 0 || !heap.empty())) {
+        if (!heap.empty() && (sp == 0 || !(stack[sp - 1]->_value.first.first - k
+                                           < k - heap.front().first))) {
+          Const_Link_type x = heap.front().second.first;
+          bool whole = heap.front().second.second;
+          std::pop_heap(heap.begin(), heap.end(), later);
+          heap.pop_back();
+          if (!whole) {
+            f(x->_value);
+            --n;
+            continue;
+          }
+          before(x, false);
+          std::push_heap(heap.begin(), heap.end(), later);
+          if (x->_left != NULL) {
+            before(Base_type::_left(x), true);
+            std::push_heap(heap.begin(), heap.end(), later);
+          }
+          if (x->_right != NULL) {
+            before(Base_type::_right(x), true);
+            std::push_heap(heap.begin(), heap.end(), later);
+          }
+        } else {
+          Const_Link_type x = stack[--sp];
+          f(x->_value);
+          --n;
+          for (x = Base_type::_right(x); x != NULL; x = Base_type::_left(x))
+            stack[sp++] = x;
+        }
+      }
+      return f;
+    }
+
+    /**
+     * Combine, in low order, the aggregate values of the intervals
+     * overlapping i. Those starting after i.first all overlap i as long as
+     * they start before its end, so whole subtrees of them are taken from
+     * their stored aggregate: O(log n + c) for c intervals starting at or
+     * before i.first and overlapping i.
+     */
+    typename Aggregate::value_type
+    aggregate_overlaps(const interval_type& i) const {
+      Interval_overlap<Key,Compare,Endpoint> overlap;
+      Compare compare;
+      typename Aggregate::value_type a = Aggregate::identity();
+      std::pair<Const_Link_type,bool> stack[STACK_SIZE];
+      int sp = 0;
+      Const_Link_type x = this->_begin();
+      bool ends_in = false; // all the low ends below x reach the end of i
+      for (;;) {
+        while (x != NULL && overlap.max_reaches(i, x->_value.second.max)
+               && overlap.min_reaches(x->_value.second.min, i)) {
+          if (ends_in && compare(i.first, x->_value.second.min)) {
+            a = Aggregate::combine(a, x->_value.second.aggregate);
+            break;
+          }
+          stack[sp++] = std::make_pair(x, ends_in);
+          ends_in = ends_in || overlap.min_reaches(x->_value.first.first, i);
+          x = Base_type::_left(x);
+        }
+        if (sp == 0)
+          return a;
+        x = stack[--sp].first;
+        ends_in = stack[sp].second;
+        if (!overlap.min_reaches(x->_value.first.first, i))
+          return a;
+        if (overlap.max_reaches(i, x->_value.first.second))
+          a = Aggregate::combine(a, Aggregate::value(x->_value.first,
+                                                     x->_value.second.data));
+        x = Base_type::_right(x);
+      }
+    }
+
+    /**
+     * Call f(s) for each span_type s of intervals overlapping i, in order
+     * of low ends. A subtree is reported whole once its min_high reaches
+     * i and its low ends all reach the end of i, the latter being bounded
+     * by the nearest ancestor it lies left of, or by the rightmost
+     * interval at the root. A run of matches consecutive in low order
+     * thus takes O(log n) spans instead of one visit per interval.
+     */
+    template <typename Function>
+    Function
+    spans(const interval_type& i, Function f) const {
+      Interval_overlap<Key,Compare,Endpoint> overlap;
+      std::pair<Const_Link_type,bool> stack[STACK_SIZE];
+      int sp = 0;
+      Const_Link_type x = this->_begin();
+      // all the low ends below x reach the end of i
+      bool ends_in = x != NULL
+        && overlap.min_reaches(Base_type::_value(this->_header._right).first.first, i);
+      for (;;) {
+        while (x != NULL && overlap.max_reaches(i, x->_value.second.max)
+               && overlap.min_reaches(x->_value.second.min, i)) {
+          if (ends_in && overlap.max_reaches(i, x->_value.second.min_high)) {
+            f(span_type(x, true));
+            break;
+          }
+          stack[sp++] = std::make_pair(x, ends_in);
+          ends_in = ends_in || overlap.min_reaches(x->_value.first.first, i);
+          x = Base_type::_left(x);
+        }
+        if (sp == 0)
+          return f;
+        x = stack[--sp].first;
+        ends_in = stack[sp].second;
+        if (!overlap.min_reaches(x->_value.first.first, i))
+          return f;
+        if (overlap.max_reaches(i, x->_value.first.second))
+          f(span_type(x, false));
+        x = Base_type::_right(x);
+      }
+    }
 
-    typedef avl_tree<std::pair<const Key,const Key>,
-                     interval_tree_value<Key,Data>,
-                     Interval_Compare<Key,Compare>,
-                     Alloc,
-                     Interval::rotation<interval_tree<Key,Data,Compare,Alloc> >,
-                     Interval::updater<interval_tree<Key,Data,Compare,Alloc> > >
-                                                    Base_type;
-    typedef interval_tree<Key,Data,Compare,Alloc>   Self;
-    typedef typename Base_type::Base_ptr            Base_ptr;
-    typedef typename Base_type::Const_Base_ptr      Const_Base_ptr;
-    typedef typename Base_type::Link_type           Link_type;
-    typedef typename Base_type::Const_Link_type     Const_Link_type;
+    /**
+     * Walk the whole tree and sample stabbing queries, in
+     * O(n log n + samples * query). Requires a numeric Key.
+     */
+    interval_tree_diagnostics
+    diagnostics(std::size_t samples = 1000, unsigned long seed = 0) const {
+      interval_tree_diagnostics d = interval_tree_diagnostics();
+      d.size = this->size();
+      if (this->_header._parent == NULL)
+        return d;
 
-  public:
-    typedef Key                                 key_type;
-    typedef std::pair<const Key,const Key>      interval_type;
-    typedef std::pair<const interval_type,Data> value_type;
-    typedef Compare                             key_compare;
-    typedef Interval_Compare<Key,Compare>       interval_compare;
-    typedef _interval_iterator<Self>            iterator;
-    typedef _interval_const_iterator<Self>      const_iterator;
+      std::vector<double> slacks;
+      slacks.reserve(d.size);
+      std::vector<std::pair<Const_Link_type,int> > stack;
+      stack.push_back(std::make_pair(this->_begin(), 0));
+      double depths = 0;
+      while (!stack.empty()) {
+        Const_Link_type x = stack.back().first;
+        int depth = stack.back().second;
+        stack.pop_back();
+        if (d.depth_histogram.size() <= static_cast<std::size_t>(depth))
+          d.depth_histogram.resize(depth + 1);
+        d.depth_histogram[depth]++;
+        depths += depth;
+        slacks.push_back(static_cast<double>(x->_value.second.max)
+                         - static_cast<double>(x->_value.first.first));
+        if (x->_left != NULL)
+          stack.push_back(std::make_pair(Base_type::_left(x), depth + 1));
+        if (x->_right != NULL)
+          stack.push_back(std::make_pair(Base_type::_right(x), depth + 1));
+      }
+      d.height = static_cast<int>(d.depth_histogram.size());
+      d.average_node_depth = depths / d.size;
 
-  public:
-    using Base_type::_header;
+      std::sort(slacks.begin(), slacks.end());
+      double sum = 0;
+      for (std::size_t i = 0; i < slacks.size(); ++i)
+        sum += slacks[i];
+      d.slack_mean = sum / slacks.size();
+      d.slack_p50 = slacks[(slacks.size() - 1) * 50 / 100];
+      d.slack_p90 = slacks[(slacks.size() - 1) * 90 / 100];
+      d.slack_p99 = slacks[(slacks.size() - 1) * 99 / 100];
+      d.slack_max = slacks.back();
 
-    interval_tree()
-    : _end(&_header, _dummy_interval, &_header) {}
+      const double low = static_cast<double>(this->_begin()->_value.second.min);
+      const double high = static_cast<double>(this->_begin()->_value.second.max);
+      std::mt19937_64 rng(seed);
+      std::uniform_real_distribution<double> point(low, high);
+      std::size_t visited = 0, matched = 0;
+      for (std::size_t i = 0; i < samples; ++i) {
+        Key k = static_cast<Key>(point(rng));
+        std::size_t v = 0;
+        _count_visits<typename Endpoint::point_type>(std::make_pair(k, k), v, matched);
+        visited += v;
+        d.visited_max = std::max(d.visited_max, v);
+      }
+      d.samples = samples;
+      if (samples > 0) {
+        d.visited_per_query = static_cast<double>(visited) / samples;
+        d.matched_per_query = static_cast<double>(matched) / samples;
+      }
+      return d;
+    }
+ 
+
+  private:
+    iterator
+    _at(Base_ptr x) {
+      return iterator(static_cast<Link_type>(x), static_cast<Link_type>(&this->_header));
+    }
 
-    interval_tree(const interval_tree<Key,Data,Compare,Alloc>& o)
-    : Base_type(o), _end(&_header, _dummy_interval, &_header)
-    {}
+    /**
+     * The node holding i, both ends matching, or the header.
+     */
+    Const_Link_type
+    _find(const interval_type& i) const {
+      Compare compare;
+      Const_Link_type x = this->_begin();
+      while (x != NULL) {
+        if (compare(i.first, x->_value.first.first))
+          x = Base_type::_left(x);
+        else if (compare(x->_value.first.first, i.first))
+          x = Base_type::_right(x);
+        else if (compare(x->_value.first.second, i.second)
+                 || compare(i.second, x->_value.first.second))
+          break;
+        else
+          return x;
+      }
+      return static_cast<Const_Link_type>(&this->_header);
+    }
 
-    /** 
-     * Find all intervals containing the key k.
+    /**
+     * Insert x from hint, building its node value in place from the
+     * pieces of x; the augmentation is set by the updater.
      */
-    const_iterator
-    equal_range(const key_type& k) const {
-      interval_type i = std::make_pair(k, k);
-      return equal_range(i);
+    ordered_iterator
+    _insert_hint(Base_ptr hint, const value_type& x) {
+      return Base_type::_insert_hint(hint, x.first, std::piecewise_construct,
+                                     std::forward_as_tuple(x.first),
+                                     std::forward_as_tuple(std::piecewise_construct,
+                                                           x.second)).first;
     }
 
+    struct _same_high {
+      bool
+      operator()(const typename Base_type::value_type& v,
+                 const interval_type& i) const {
+        Compare compare;
+        return !compare(v.first.second, i.second)
+          && !compare(i.second, v.first.second);
+      }
+    };
+
     /**
-     * Find all intervals overlapping interval i.
+     * Whether an interval ending at high lies before k, and whether one
+     * starting at low lies after k.
      */
-    const_iterator
-    equal_range(const interval_type& i) const {
-      Base_ptr root = this->_header._parent;
-      return const_iterator(static_cast<Link_type>(root), i, &this->_header);
+    static
+    bool
+    _ends_before(const Key& high, const Key& k) {
+      return Interval::_before<!Endpoint::high_closed>::apply(Compare(), high, k);
+    }
+
+    static
+    bool
+    _starts_after(const Key& k, const Key& low) {
+      return Interval::_before<!Endpoint::low_closed>::apply(Compare(), k, low);
     }
 
     /**
-     * Returns a pair, with its member pair::first set to an iterator pointing
-     * to either the newly inserted interval or to the element that already had
-     * its same interval in the map.
-     * The pair::second element in the pair is set to true if a new element was
-     * inserted or false if an element with the same key existed.
+     * Call f(x, true) for the maximal subtrees x ending before k, and
+     * f(x, false) for the nodes x ending before k in the other subtrees.
      */
+    template <typename Function>
     void
-    insert(const value_type& x) {
-      typename Base_type::mapped_type data;
-      data.max = x.first.second;
-      data.min = x.first.first;
-      data.data = x.second;
-      Base_type::insert(std::make_pair(x.first, data));
+    _before_roots(const Key& k, Function& f) const {
+      Const_Link_type stack[STACK_SIZE];
+      int sp = 0;
+      if (this->_begin() != NULL)
+        stack[sp++] = this->_begin();
+      while (sp > 0) {
+        Const_Link_type x = stack[--sp];
+        if (!_ends_before(x->_value.second.min, k))
+          continue;
+        if (_ends_before(x->_value.second.max, k)) {
+          f(x, true);
+          continue;
+        }
+        if (_ends_before(x->_value.first.second, k))
+          f(x, false);
+        if (x->_right != NULL)
+          stack[sp++] = Base_type::_right(x);
+        if (x->_left != NULL)
+          stack[sp++] = Base_type::_left(x);
+      }
     }
 
-    iterator
-    end() {
-      return _end;
+    /**
+     * Free the intervals ending before t and relink the others, chained
+     * in order, into a balanced tree.
+     */
+    size_type
+    _rebuild_without(const Key& t) {
+      const size_type n = this->size();
+      Link_type list = NULL, last = NULL;
+      size_type kept = 0;
+      Link_type stack[STACK_SIZE];
+      int sp = 0;
+      Link_type x = this->_begin();
+      for (;;) {
+        for (; x != NULL; x = Base_type::_left(x))
+          stack[sp++] = x;
+        if (sp == 0)
+          break;
+        x = stack[--sp];
+        Link_type next = Base_type::_right(x);
+        if (_ends_before(x->_value.first.second, t)) {
+          this->_destroy_node(x);
+        } else {
+          if (last != NULL)
+            last->_right = x;
+          else
+            list = x;
+          last = x;
+          ++kept;
+        }
+        x = next;
+      }
+      this->_rebuild(list, kept);
+      return n - kept;
     }
 
-    const_iterator
-    end() const {
-      return _end;
+    /**
+     * Keep the subtree or node reaching the furthest before k.
+     */
+    struct _last_before {
+      _last_before() : _node(NULL), _whole(false), _high() {}
+
+      void
+      operator()(Const_Link_type x, bool whole) {
+        const Key& high = whole ? x->_value.second.max : x->_value.first.second;
+        if (_node == NULL || Compare()(_high, high)) {
+          _node = x;
+          _whole = whole;
+          _high = high;
+        }
+      }
+
+      Const_Link_type _node;
+      bool            _whole;
+      Key             _high;
+    };
+
+    /**
+     * Collect subtrees and nodes before k, keyed by how far they reach,
+     * for a heap.
+     */
+    struct _before_heap {
+      typedef std::pair<Key,std::pair<Const_Link_type,bool> > entry;
+
+      struct later {
+        bool operator()(const entry& x, const entry& y) const
+        { return Compare()(x.first, y.first); }
+      };
+
+      void
+      operator()(Const_Link_type x, bool whole) {
+        _heap.push_back(entry(whole ? x->_value.second.max : x->_value.first.second,
+                              std::make_pair(x, whole)));
+      }
+
+      std::vector<entry> _heap;
+    };
+
+    /**
+     * Whether an interval starting at low overlaps a cluster ending at high,
+     * low not being below the cluster's low end.
+     */
+    static
+    bool
+    _joins(const Key& low, const Key& high) {
+      return Interval::_before<Endpoint::low_closed && Endpoint::high_closed>
+        ::apply(Compare(), low, high);
+    }
+
+    /**
+     * Call f(x) for the nodes x overlapping i, by increasing low ends,
+     * skipping the subtrees whose max and min show no overlap or whose
+     * max f.wants() rejects, and stopping at the first low end past i or
+     * when f(x) returns false.
+     */
+    template <typename Query, typename Function>
+    void
+    _overlaps_in_order(const interval_type& i, Function& f) const {
+      Interval_overlap<Key,Compare,Endpoint,Query> overlap;
+      Const_Link_type stack[STACK_SIZE];
+      int sp = 0;
+      Const_Link_type x = this->_begin();
+      for (;;) {
+        while (x != NULL && overlap.max_reaches(i, x->_value.second.max)
+               && overlap.min_reaches(x->_value.second.min, i)
+               && f.wants(x->_value.second.max)) {
+          stack[sp++] = x;
+          x = Base_type::_left(x);
+        }
+        if (sp == 0)
+          return;
+        x = stack[--sp];
+        if (!overlap.min_reaches(x->_value.first.first, i))
+          return;
+        if (overlap.max_reaches(i, x->_value.first.second) && !f(x))
+          return;
+        x = Base_type::_right(x);
+      }
+    }
+
+    /**
+     * Sweep the intervals overlapping w by increasing low ends, keeping
+     * the weights of those still open in a heap ordered by high ends.
+     * O(log n + k log k) for k intervals overlapping w.
+     */
+    template <typename Weight, typename Function>
+    struct _peak_sweep {
+      typedef std::pair<Key,Weight> ending;
+
+      struct later {
+        bool operator()(const ending& x, const ending& y) const
+        { return Compare()(y.first, x.first); }
+      };
+
+      _peak_sweep(const Key& start, Function& weight)
+      : _start(start), _weight(weight), _load(), _peak(), _point(start) {}
+
+      bool wants(const Key&) const { return true; }
+
+      bool
+      operator()(Const_Link_type x) {
+        Compare compare;
+        const Key& low = compare(x->_value.first.first, _start)
+          ? _start : x->_value.first.first;
+        while (!_open.empty() && !_joins(low, _open.front().first)) {
+          _load -= _open.front().second;
+          std::pop_heap(_open.begin(), _open.end(), later());
+          _open.pop_back();
+        }
+        Weight w = _weight(x->_value);
+        _open.push_back(ending(x->_value.first.second, w));
+        std::push_heap(_open.begin(), _open.end(), later());
+        _load += w;
+        if (_peak < _load) {
+          _peak = _load;
+          _point = low;
+        }
+        return true;
+      }
+
+      const Key&          _start;
+      Function&           _weight;
+      std::vector<ending> _open;
+      Weight              _load;
+      Weight              _peak;
+      Key                 _point;
+    };
+
+    template <typename Weight, typename Function>
+    std::pair<Weight,Key>
+    _peak(const interval_type& w, Function weight) const {
+      _peak_sweep<Weight,Function> sweep(w.first, weight);
+      _overlaps_in_order<Endpoint>(w, sweep);
+      return std::pair<Weight,Key>(sweep._peak, sweep._point);
+    }
+
+    /**
+     * Sweep the intervals overlapping a window by increasing low ends,
+     * clipped to it, adding what each one covers past the reach of the
+     * previous ones. Subtrees ending within the reach add nothing and
+     * are skipped, so does the rest once the reach leaves the window.
+     */
+    struct _cover_sweep {
+      explicit _cover_sweep(const interval_type& w)
+      : _end(w.second), _reach(w.first), _length() {}
+
+      bool wants(const Key& max) const { return Compare()(_reach, max); }
+
+      bool
+      operator()(Const_Link_type x) {
+        Compare compare;
+        const Key& high = compare(_end, x->_value.first.second)
+          ? _end : x->_value.first.second;
+        if (compare(_reach, high)) {
+          _length += high - (compare(_reach, x->_value.first.first)
+                             ? x->_value.first.first : _reach);
+          _reach = high;
+        }
+        return compare(_reach, _end);
+      }
+
+      const Key& _end;
+      Key        _reach;
+      Key        _length;
+    };
+
+    /**
+     * Spread the intervals overlapping a window over bins: the bins an
+     * interval spans entirely, and all those it touches, are counted in
+     * difference arrays, the two it ends in get the covered part.
+     * O(log bins) per interval.
+     */
+    struct _bin_sweep {
+      _bin_sweep(const interval_type& w, std::size_t bins)
+      : _bounds(bins + 1), _covered(bins), _spanning(bins + 1),
+        _touching(bins + 1) {
+        for (std::size_t j = 0; j <= bins; ++j)
+          _bounds[j] = Interval::_bins<Key>::bound(w.first, w.second, j, bins);
+      }
+
+      bool wants(const Key&) const { return true; }
+
+      bool
+      operator()(Const_Link_type x) {
+        Compare compare;
+        const Key& first = _bounds.front();
+        const Key& last = _bounds.back();
+        const Key& low = compare(x->_value.first.first, first)
+          ? first : x->_value.first.first;
+        const Key& high = compare(last, x->_value.first.second)
+          ? last : x->_value.first.second;
+        if (!compare(low, high))
+          return true;
+        std::size_t l = std::upper_bound(_bounds.begin(), _bounds.end(), low,
+                                         compare) - _bounds.begin() - 1;
+        std::size_t h = std::lower_bound(_bounds.begin(), _bounds.end(), high,
+                                         compare) - _bounds.begin() - 1;
+        if (l == h) {
+          _covered[l] += high - low;
+        } else {
+          _covered[l] += _bounds[l + 1] - low;
+          _covered[h] += high - _bounds[h];
+          _spanning[l + 1]++;
+          _spanning[h]--;
+        }
+        _touching[l]++;
+        _touching[h + 1]--;
+        return true;
+      }
+
+      std::vector<Key>       _bounds;
+      std::vector<Key>       _covered;
+      std::vector<long long> _spanning;
+      std::vector<long long> _touching;
+    };
+
+    /**
+     * Visit the gaps between the intervals by increasing position,
+     * starting from reach and calling sink(start, end) on those the sink
+     * fits until it returns false. Subtrees ending within the reach, or
+     * whose gap bound the sink does not fit, are skipped. Returns whether
+     * the sink stopped the walk, reach being the start of the next gap.
+     */
+    template <typename Sink>
+    bool
+    _walk_gaps(Key& reach, Sink& sink) const {
+      typedef Interval::_gap<Key,Compare> gap;
+      Compare compare;
+      Const_Link_type stack[STACK_SIZE];
+      int sp = 0;
+      Const_Link_type x = this->_begin();
+      for (;;) {
+        for (; x != NULL; x = Base_type::_left(x)) {
+          const typename Base_type::mapped_type& s = x->_value.second;
+          if (!compare(reach, s.max))
+            break;
+          if (!_fits_gap(sink, s, std::integral_constant<bool, _tracks_gaps>())
+              && !sink.fits(gap::between(reach, s.min))) {
+            reach = s.max;
+            break;
+          }
+          stack[sp++] = x;
+        }
+        if (sp == 0)
+          return false;
+        x = stack[--sp];
+        const Key& low = x->_value.first.first;
+        if (Interval::_empty<Endpoint,Key,Compare>(low, x->_value.first.second)) {
+          x = Base_type::_right(x);
+          continue;
+        }
+        if (sink.fits(gap::between(reach, low)) && !sink(reach, low))
+          return true;
+        if (compare(reach, x->_value.first.second))
+          reach = x->_value.first.second;
+        x = Base_type::_right(x);
+      }
+    }
+
+    /**
+     * Whether the sink may fit a gap inside the subtree holding s, which
+     * it always may without a bound.
+     */
+    template <typename Sink>
+    static
+    bool
+    _fits_gap(const Sink& sink, const typename Base_type::mapped_type& s, std::true_type)
+    { return sink.fits(s.gap); }
+
+    template <typename Sink>
+    static
+    bool
+    _fits_gap(const Sink&, const typename Base_type::mapped_type&, std::false_type)
+    { return true; }
+
+    struct _first_fit {
+      explicit _first_fit(const Key& length) : _length(length) {}
+
+      bool fits(const Key& gap) const { return !(gap < _length); }
+
+      bool operator()(const Key&, const Key&) const { return false; }
+
+      const Key& _length;
+    };
+
+    template <typename OutputIterator>
+    struct _gap_writer {
+      _gap_writer(const Key& end, OutputIterator out)
+      : _end(end), _out(out) {}
+
+      bool fits(const Key& gap) const { return Key() < gap; }
+
+      bool
+      operator()(const Key& start, const Key& end) {
+        Compare compare;
+        if (!compare(start, _end))
+          return false;
+        *_out++ = interval_type(start, compare(_end, end) ? _end : end);
+        return compare(end, _end);
+      }
+
+      const Key&     _end;
+      OutputIterator _out;
+    };
+
+    template <typename A, typename B, typename Sink>
+    friend void overlap_join_parallel(const A&, const B&, std::vector<Sink>&);
+
+    /**
+     * Low ends of the nodes above the given depth, in order.
+     */
+    void
+    _top_lows(std::size_t depth, std::vector<Key>& out) const {
+      std::vector<std::pair<Const_Link_type,std::size_t> > stack;
+      Const_Link_type x = this->_begin();
+      std::size_t d = 0;
+      while (x != NULL || !stack.empty()) {
+        while (x != NULL && d < depth) {
+          stack.push_back(std::make_pair(x, d));
+          x = Base_type::_left(x);
+          ++d;
+        }
+        if (stack.empty())
+          break;
+        x = stack.back().first;
+        d = stack.back().second;
+        stack.pop_back();
+        out.push_back(x->_value.first.first);
+        x = Base_type::_right(x);
+        ++d;
+      }
+    }
+
+    /**
+     * Run the traversal of the iterators, tallying the nodes it visits
+     * whatever the Stats policy of the tree.
+     */
+    template <typename Query>
+    void
+    _count_visits(const interval_type& i, std::size_t& visited,
+                  std::size_t& matched) const {
+      Const_Link_type e = static_cast<Const_Link_type>(&this->_header);
+      _interval_const_iterator<Self,Query,Interval::_visit_stats> it(this->_begin(), i, e);
+      while (it._node != e)
+        ++it;
+      visited += it.stats().visited;
+      matched += it.stats().matched;
     }
- 
 
-  private:
     interval_type                 _dummy_interval;
     iterator                      _end;
   };
 
+  namespace Interval {
+    /**
+     * In-order walk over the intervals whose low ends lie in [lo,hi), either
+     * bound being optional. Like an in-order iterator, it keeps the stack of
+     * nodes whose left subtree is done, but it also holds the next subtree
+     * to descend, so that this whole subtree can be skipped knowing only
+     * its min and max.
+     */
+    template <typename Tree>
+    struct _join_cursor {
+      typedef typename Tree::key_type        Key;
+      typedef typename Tree::Const_Link_type Const_Link_type;
+
+      _join_cursor(const Tree& t, const Key* lo, const Key* hi)
+      : _subtree(static_cast<Const_Link_type>(t._header._parent)),
+        _lo(lo), _hi(hi) {
+        _stack.reserve(STACK_SIZE);
+      }
+
+      bool
+      done() const {
+        return (_subtree == NULL && _stack.empty())
+          || (_hi != NULL && !_compare(next_low(), *_hi));
+      }
+
+      /**
+       * Lower bound of the low ends left.
+       */
+      const Key&
+      next_low() const {
+        return _subtree != NULL ? _subtree->_value.second.min
+                                : _stack.back()->_value.first.first;
+      }
+
+      bool
+      at_subtree() const
+      { return _subtree != NULL; }
+
+      /**
+       * The subtree to descend, or else the next node.
+       */
+      Const_Link_type
+      top() const
+      { return _subtree != NULL ? _subtree : _stack.back(); }
+
+      void
+      pop() {
+        if (_subtree != NULL)
+          _subtree = NULL;
+        else {
+          _subtree = Tree::_right(_stack.back());
+          _stack.pop_back();
+        }
+      }
+
+      void
+      expand() {
+        Const_Link_type x = _subtree;
+        const Key& low = x->_value.first.first;
+        if (_lo != NULL && _compare(low, *_lo))
+          _subtree = Tree::_right(x);
+        else {
+          if (_hi == NULL || _compare(low, *_hi))
+            _stack.push_back(x);
+          _subtree = Tree::_left(x);
+        }
+      }
+
+    private:
+      Const_Link_type              _subtree;
+      std::vector<Const_Link_type> _stack;
+      const Key*                   _lo;
+      const Key*                   _hi;
+      typename Tree::key_compare   _compare;
+    };
+
+    /**
+     * Call sink with the node of the first tree first.
+     */
+    template <bool Left>
+    struct _join_emit {
+      template <typename Sink, typename X, typename Y>
+      static void apply(Sink& sink, const X& x, const Y& y) { sink(x, y); }
+    };
+
+    template <>
+    struct _join_emit<false> {
+      template <typename Sink, typename X, typename Y>
+      static void apply(Sink& sink, const X& x, const Y& y) { sink(y, x); }
+    };
+
+    /**
+     * Sweep both trees by increasing low ends. Each tree keeps the list of
+     * its intervals that may still overlap the intervals to come from the
+     * other one; when an interval comes, every entry of the other list is
+     * either reported or dropped for good, so a join costs
+     * O(n + m + output). A subtree is skipped when the other list is empty
+     * and the next low end of the other tree does not reach its max.
+     */
+    template <typename TreeA, typename TreeB>
+    struct _overlap_join {
+      typedef typename TreeA::key_type          Key;
+      typedef typename TreeA::key_compare       Compare;
+      typedef typename TreeA::endpoint_type     Endpoint;
+      typedef typename TreeA::Const_Link_type   Link_a;
+      typedef typename TreeB::Const_Link_type   Link_b;
+
+      template <typename Sink>
+      static
+      void
+      run(const TreeA& a, const TreeB& b, const Key* lo, const Key* hi,
+          Sink& sink) {
+        _join_cursor<TreeA> ca(a, lo, hi);
+        _join_cursor<TreeB> cb(b, lo, hi);
+        std::vector<Link_a> active_a;
+        std::vector<Link_b> active_b;
+        if (lo != NULL) {
+          // Intervals starting before the range may overlap ones inside it.
+          _crossing(a, *lo, active_a);
+          _crossing(b, *lo, active_b);
+        }
+        Compare compare;
+        for (;;) {
+          bool a_done = ca.done(), b_done = cb.done();
+          if ((a_done && (b_done || active_a.empty()))
+              || (b_done && active_b.empty()))
+            break;
+          if (!a_done && (b_done || !compare(cb.next_low(), ca.next_low())))
+            _advance<true>(ca, active_a, cb, active_b, sink);
+          else
+            _advance<false>(cb, active_b, ca, active_a, sink);
+        }
+      }
+
+      /**
+       * Nodes of t starting before k which may overlap an interval
+       * starting at k.
+       */
+      template <typename Tree, typename Link>
+      static
+      void
+      _crossing(const Tree& t, const Key& k, std::vector<Link>& out) {
+        Compare compare;
+        std::vector<Link> stack;
+        if (t._header._parent != NULL)
+          stack.push_back(static_cast<Link>(t._header._parent));
+        while (!stack.empty()) {
+          Link x = stack.back();
+          stack.pop_back();
+          if (x->_left != NULL && _reaches(k, Tree::_left(x)->_value.second.max))
+            stack.push_back(Tree::_left(x));
+          if (compare(x->_value.first.first, k)) {
+            if (x->_right != NULL
+                && compare(Tree::_right(x)->_value.second.min, k))
+              stack.push_back(Tree::_right(x));
+            if (_reaches(k, x->_value.first.second))
+              out.push_back(x);
+          }
+        }
+      }
+
+    private:
+      /**
+       * Whether an interval starting at low may overlap one ending at high.
+       */
+      static
+      bool
+      _reaches(const Key& low, const Key& high) {
+        return _before<Endpoint::low_closed && Endpoint::high_closed>
+          ::apply(Compare(), low, high);
+      }
+
+      template <bool Left, typename Self, typename Other, typename Sink>
+      static
+      void
+      _advance(_join_cursor<Self>& self,
+               std::vector<typename Self::Const_Link_type>& self_active,
+               const _join_cursor<Other>& other,
+               std::vector<typename Other::Const_Link_type>& other_active,
+               Sink& sink) {
+        typename Self::Const_Link_type x = self.top();
+        if (self.at_subtree()) {
+          const Key& low = self.next_low();
+          for (std::size_t i = 0; i < other_active.size(); )
+            if (!_reaches(low, other_active[i]->_value.first.second)) {
+              other_active[i] = other_active.back();
+              other_active.pop_back();
+            } else
+              ++i;
+          if (other_active.empty()
+              && (other.done() || !_reaches(other.next_low(), x->_value.second.max)))
+            self.pop();
+          else
+            self.expand();
+          return;
+        }
+
+        // Other intervals start at or before x: they overlap x if they
+        // reach its low end, and will never overlap anything if not.
+        self.pop();
+        const Key& low = x->_value.first.first;
+        const Key& high = x->_value.first.second;
+        for (std::size_t i = 0; i < other_active.size(); ) {
+          const typename Other::Const_Link_type o = other_active[i];
+          if (!_reaches(low, o->_value.first.second)) {
+            other_active[i] = other_active.back();
+            other_active.pop_back();
+            continue;
+          }
+          if (_reaches(o->_value.first.first, high))
+            _join_emit<Left>::apply(sink, x->_value, o->_value);
+          ++i;
+        }
+        if (!other.done())
+          self_active.push_back(x);
+      }
+    };
+  }
+
+  /**
+   * Report every pair of overlapping intervals (x from a, y from b) as
+   * sink(x, y), where x and y are the values iterators point to.
+   * Both trees must share Key, Compare and Endpoint.
+   */
+  template <typename TreeA, typename TreeB, typename Sink>
+  void
+  overlap_join(const TreeA& a, const TreeB& b, Sink sink) {
+    Interval::_overlap_join<TreeA,TreeB>::run(a, b, NULL, NULL, sink);
+  }
+
+  /**
+   * Same as overlap_join, on sinks.size() threads each calling its own
+   * sink. The key space is cut at low ends taken from the top levels of
+   * the larger tree into about four ranges per thread, and a pair is
+   * reported by the range holding the greater of its two low ends.
+   */
+  template <typename TreeA, typename TreeB, typename Sink>
+  void
+  overlap_join_parallel(const TreeA& a, const TreeB& b, std::vector<Sink>& sinks) {
+    typedef typename TreeA::key_type Key;
+    if (sinks.size() <= 1) {
+      if (!sinks.empty())
+        Interval::_overlap_join<TreeA,TreeB>::run(a, b, NULL, NULL, sinks[0]);
+      return;
+    }
+
+    std::vector<Key> cuts;
+    std::size_t depth = 0;
+    while ((std::size_t(1) << depth) < 4 * sinks.size())
+      ++depth;
+    if (a.size() >= b.size())
+      a._top_lows(depth, cuts);
+    else
+      b._top_lows(depth, cuts);
+
+    // The calling thread takes the last sink. The futures wait for their
+    // workers when destroyed, so nothing is left running if a launch or
+    // a sink throws.
+    std::atomic<std::size_t> next(0);
+    auto work = [&](std::size_t t) {
+      for (std::size_t r; (r = next.fetch_add(1)) <= cuts.size(); ) {
+        const Key* lo = r == 0 ? NULL : &cuts[r - 1];
+        const Key* hi = r == cuts.size() ? NULL : &cuts[r];
+        Interval::_overlap_join<TreeA,TreeB>::run(a, b, lo, hi, sinks[t]);
+      }
+    };
+    std::vector<std::future<void> > workers;
+    workers.reserve(sinks.size() - 1);
+    for (std::size_t t = 0; t + 1 < sinks.size(); ++t)
+      workers.push_back(std::async(std::launch::async, work, t));
+    work(sinks.size() - 1);
+    for (std::size_t t = 0; t < workers.size(); ++t)
+      workers[t].get();
+  }
+
 }
 
 #endif /* !INTERVAL_TREE_HXX_ */
@@ -0,0 +1,235 @@
+/******************************************************************************
+ *                                 Test
+ *      Random merges, batch insertions and batch erasures compared with
+ *              std::map, on one thread and on several.
+ *
+ * The trees are large enough for the root levels to run on std::async
+ * workers when given more than one thread. Nodes are counted through
+ * counting_allocator, so that a dropped or erased node left allocated, or
+ * one leaked by a throwing copy, fails the check as a wrong content does.
+ *****************************************************************************/
+
+#include <algorithm>
+#include <cstdlib>
+#include <map>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+#include "checked_tree.hpp"
+#include "counting_allocator.hpp"
+
+namespace {
+
+  /**
+   * Value whose copy throws once the countdown reaches zero, counting the
+   * live instances.
+   */
+  struct fragile {
+    static int live;
+    static int countdown;
+
+    int v;
+
+    explicit fragile(int x = 0) : v(x) { ++live; }
+
+    fragile(const fragile& o) : v(o.v) {
+      if (countdown > 0 && --countdown == 0)
+        throw std::runtime_error("fragile copy");
+      ++live;
+    }
+
+    ~fragile() { --live; }
+
+    bool operator==(const fragile& o) const { return v == o.v; }
+  };
+
+  int fragile::live = 0;
+  int fragile::countdown = 0;
+
+  typedef std::pair<const int,int> Value;
+
+  template <typename Sizes>
+  struct trees {
+    typedef test::checked_tree<int, int, Sizes,
+                               DS::counting_allocator<Value> > type;
+  };
+
+  /**
+   * Whether t matches m and holds exactly its own nodes.
+   */
+  template <typename Tree>
+  bool
+  _same(const Tree& t, const std::map<int,int>& m,
+        const DS::allocation_counters& counters) {
+    return t.valid() && t.same(m) && counters.live_allocations() == t.size();
+  }
+
+  /**
+   * Fill t and m with n random keys from [0,range), the value telling
+   * which tree it came from.
+   */
+  template <typename Tree>
+  void
+  _fill(Tree& t, std::map<int,int>& m, int n, int range, int tag,
+        std::mt19937& rng) {
+    std::uniform_int_distribution<int> key(0, range - 1);
+    for (int i = 0; i < n; ++i) {
+      int k = key(rng);
+      t.insert(Value(k, tag));
+      m.insert(std::make_pair(k, tag));
+    }
+  }
+
+  /**
+   * Merge copies of random trees of small and large sizes, overlapping in
+   * part, keeping the values already in the target.
+   */
+  template <typename Sizes>
+  void
+  _merge(const char* name) {
+    typedef typename trees<Sizes>::type Tree;
+    static const int sizes[] = { 0, 1, 100, 20000, 40000 };
+    std::mt19937 rng(43);
+    for (int i = 0; i < 5; ++i)
+      for (int j = 0; j < 5; ++j) {
+        DS::allocation_counters counters;
+        DS::counting_allocator<Value> alloc(counters);
+        Tree a(alloc), b(alloc);
+        std::map<int,int> m, mb;
+        _fill(a, m, sizes[i], 60000, 1, rng);
+        _fill(b, mb, sizes[j], 60000, 2, rng);
+        m.insert(mb.begin(), mb.end());
+        for (unsigned threads = 0; threads <= 4; ++threads) {
+          Tree to(a), from(b);
+          to.merge(from, threads);
+          test::check(to.valid() && to.same(m) && from.empty()
+                      && counters.live_allocations() == a.size() + b.size()
+                        + to.size(), name, i * 5 + j);
+        }
+      }
+  }
+
+  /**
+   * Insert sorted batches holding repeated keys, keys already in the
+   * tree and, every other round, values out of order: the first value
+   * given for a key, or the one already there, is kept.
+   */
+  template <typename Sizes>
+  void
+  _insert_batch(const char* name, unsigned threads) {
+    typedef typename trees<Sizes>::type Tree;
+    std::mt19937 rng(44 + threads);
+    std::uniform_int_distribution<int> key(0, 59999);
+    for (int round = 0; round < 8; ++round) {
+      DS::allocation_counters counters;
+      Tree t((DS::counting_allocator<Value>(counters)));
+      std::map<int,int> m;
+      _fill(t, m, round % 4 == 0 ? 0 : 20000, 60000, -1, rng);
+      std::vector<int> keys;
+      for (int i = 0; i < 30000; ++i)
+        keys.push_back(key(rng));
+      std::sort(keys.begin(), keys.end());
+      if (round % 2 == 1)
+        for (int i = 0; i < 20; ++i)
+          std::swap(keys[key(rng) % keys.size()], keys[key(rng) % keys.size()]);
+      std::vector<Value> batch;
+      for (std::size_t i = 0; i < keys.size(); ++i) {
+        batch.push_back(Value(keys[i], static_cast<int>(i)));
+        m.insert(std::make_pair(keys[i], static_cast<int>(i)));
+      }
+      t.insert_batch(batch.begin(), batch.end(), threads);
+      test::check(_same(t, m, counters), name, round);
+    }
+  }
+
+  /**
+   * Erase sorted batches holding repeated keys and keys not in the tree,
+   * from trees large enough to split the batch across threads.
+   */
+  template <typename Sizes>
+  void
+  _erase_batch(const char* name, unsigned threads) {
+    typedef typename trees<Sizes>::type Tree;
+    static const int counts[] = { 0, 1, 50, 3000, 20000, 60000 };
+    std::mt19937 rng(45 + threads);
+    std::uniform_int_distribution<int> key(-10, 60009);
+    for (int round = 0; round < 6; ++round) {
+      DS::allocation_counters counters;
+      Tree t((DS::counting_allocator<Value>(counters)));
+      std::map<int,int> m;
+      _fill(t, m, 30000, 60000, 0, rng);
+      std::vector<int> keys;
+      for (int i = 0; i < counts[round]; ++i)
+        keys.push_back(key(rng));
+      std::sort(keys.begin(), keys.end());
+      std::size_t expected = 0;
+      for (std::size_t i = 0; i < keys.size(); ++i)
+        expected += m.erase(keys[i]);
+      std::size_t erased = t.erase_batch(keys.begin(), keys.end(), threads);
+      test::check(erased == expected && _same(t, m, counters), name, round);
+    }
+  }
+
+  /**
+   * Throw from the copy of each value of a sorted batch in turn, then
+   * from one of the first values of an unsorted one: no node nor value
+   * may leak, and a sorted batch leaves the tree as it was.
+   */
+  void
+  _unwind(const char* name, unsigned threads) {
+    typedef std::pair<const int,fragile> Fragile_value;
+    typedef test::checked_tree<int, fragile, DS::AVL::unsized,
+                               DS::counting_allocator<Fragile_value> > Tree;
+    std::vector<Fragile_value> sorted, unsorted;
+    for (int i = 0; i < 200; ++i)
+      sorted.push_back(Fragile_value(2 * i, fragile(i)));
+    for (int i = 0; i < 200; ++i)
+      unsorted.push_back(Fragile_value((i * 37) % 200 * 2 + 1, fragile(i)));
+    for (int at = 1; at <= 200; at += 7) {
+      DS::allocation_counters counters;
+      int live = fragile::live;
+      {
+        Tree t((DS::counting_allocator<Fragile_value>(counters)));
+        for (int i = 0; i < 100; ++i)
+          t.insert(Fragile_value(4 * i + 1, fragile(i)));
+        std::size_t n = t.size();
+        bool thrown = false;
+        fragile::countdown = at;
+        try {
+          t.insert_batch(sorted.begin(), sorted.end(), threads);
+        } catch (const std::runtime_error&) {
+          thrown = true;
+        }
+        test::check(thrown && t.valid() && t.size() == n
+                    && counters.live_allocations() == n, name, at);
+        thrown = false;
+        fragile::countdown = at % 50 + 1;
+        try {
+          t.insert_batch(unsorted.begin(), unsorted.end(), threads);
+        } catch (const std::runtime_error&) {
+          thrown = true;
+        }
+        fragile::countdown = 0;
+        test::check(thrown && t.valid()
+                    && counters.live_allocations() == t.size(), name, at);
+      }
+      test::check(fragile::live == live
+                  && counters.live_allocations() == 0, name, at);
+    }
+  }
+}
+
+int
+main() {
+  _merge<DS::AVL::unsized>("merge unsized");
+  _merge<DS::AVL::sized>("merge sized");
+  for (unsigned threads = 0; threads <= 4; ++threads) {
+    _insert_batch<DS::AVL::unsized>("insert_batch unsized", threads);
+    _insert_batch<DS::AVL::sized>("insert_batch sized", threads);
+    _erase_batch<DS::AVL::unsized>("erase_batch unsized", threads);
+    _erase_batch<DS::AVL::sized>("erase_batch sized", threads);
+    _unwind("unwind", threads);
+  }
+  return test::failures() == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,132 @@
+/******************************************************************************
+ *                                 Test
+ *          Structural checks shared by the randomized tree tests.
+ *****************************************************************************/
+
+#ifndef CHECKED_TREE_HPP_
+# define CHECKED_TREE_HPP_
+
+# include <cstdio>
+# include <functional>
+# include <map>
+# include <memory>
+
+# include "avl_tree.hpp"
+
+namespace test {
+
+  inline
+  int&
+  failures() {
+    static int n = 0;
+    return n;
+  }
+
+  inline
+  void
+  check(bool ok, const char* what, long k) {
+    if (!ok) {
+      std::printf("FAIL %s at %ld\n", what, k);
+      ++failures();
+    }
+  }
+
+  /**
+   * avl_tree opening its links to valid(), which walks the whole tree.
+   */
+  template <typename Key,
+            typename Data,
+            typename Sizes,
+            typename Alloc = std::allocator<std::pair<const Key,Data> > >
+  class checked_tree : public DS::avl_tree<Key,Data,std::less<Key>,Alloc,
+                                           DS::AVL::rotation,
+                                           DS::AVL::updater,
+                                           Sizes>
+  {
+    typedef DS::avl_tree<Key,Data,std::less<Key>,Alloc,
+                         DS::AVL::rotation,DS::AVL::updater,Sizes> Base_type;
+    typedef typename Base_type::Base_ptr Base_ptr;
+    typedef typename Base_type::Link_type Link_type;
+
+  public:
+    checked_tree() {}
+
+    explicit checked_tree(const Alloc& a)
+    : Base_type(a) {}
+
+    /**
+     * Whether the links, balances, subtree sizes, key order and size()
+     * agree with each other.
+     */
+    bool
+    valid() const {
+      Base_ptr header = const_cast<Base_ptr>(
+        static_cast<const DS::_avl_tree_node_base*>(&this->_header));
+      Base_ptr root = header->_parent;
+      if (root == NULL)
+        return this->_node_count == 0 && header->_left == header
+          && header->_right == header;
+      if (root->_parent != header)
+        return false;
+      Base_ptr leftmost = root, rightmost = root;
+      while (leftmost->_left != NULL) leftmost = leftmost->_left;
+      while (rightmost->_right != NULL) rightmost = rightmost->_right;
+      if (header->_left != leftmost || header->_right != rightmost)
+        return false;
+      std::size_t n = 0;
+      return _valid(root, n) >= 0 && n == this->_node_count
+        && _ordered();
+    }
+
+    /**
+     * Whether the values are those of m, in order.
+     */
+    bool
+    same(const std::map<Key,Data>& m) const {
+      if (this->size() != m.size())
+        return false;
+      typename Base_type::const_iterator i = this->begin();
+      for (typename std::map<Key,Data>::const_iterator j = m.begin();
+           j != m.end(); ++i, ++j)
+        if (i->first != j->first || !(i->second == j->second))
+          return false;
+      return i == this->end();
+    }
+
+  private:
+    /**
+     * Height of x, or -1 when its subtree is broken; n counts its nodes.
+     */
+    static
+    int
+    _valid(Base_ptr x, std::size_t& n) {
+      if (x == NULL)
+        return 0;
+      std::size_t nl = 0, nr = 0;
+      if ((x->_left != NULL && x->_left->_parent != x)
+          || (x->_right != NULL && x->_right->_parent != x))
+        return -1;
+      int hl = _valid(x->_left, nl), hr = _valid(x->_right, nr);
+      if (hl < 0 || hr < 0 || x->_balance != hr - hl
+          || x->_balance < -1 || x->_balance > 1)
+        return -1;
+      n = nl + nr + 1;
+      if (Sizes::counted && Sizes::size(x) != n)
+        return -1;
+      return (hl > hr ? hl : hr) + 1;
+    }
+
+    bool
+    _ordered() const {
+      typename Base_type::const_iterator i = this->begin(), j = i;
+      if (i == this->end())
+        return true;
+      for (++j; j != this->end(); ++i, ++j)
+        if (!(i->first < j->first))
+          return false;
+      return true;
+    }
+  };
+}
+
+#endif
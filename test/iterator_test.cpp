@@ -0,0 +1,89 @@
+/******************************************************************************
+ *                                 Test
+ *          Point queries compared with end() under every endpoint policy.
+ *
+ * Exits with a non zero status, after printing the failed check, when a
+ * count differs from a scan of the stored intervals.
+ *****************************************************************************/
+
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <utility>
+#include <vector>
+
+#include "interval_tree.hpp"
+
+namespace {
+
+  typedef std::pair<int,int> Span;
+
+  int failures = 0;
+
+  void
+  _check(bool ok, const char* what, int k) {
+    if (!ok) {
+      std::printf("FAIL %s at %d\n", what, k);
+      ++failures;
+    }
+  }
+
+  /**
+   * Whether k lies in s under the endpoint policy Endpoint.
+   */
+  template <typename Endpoint>
+  bool
+  _contains(const Span& s, int k) {
+    return (Endpoint::low_closed ? s.first <= k : s.first < k)
+        && (Endpoint::high_closed ? k <= s.second : k < s.second);
+  }
+
+  /**
+   * Count the intervals holding k by looping from equal_range(k) to end()
+   * on a non const tree, then on a const one, and compare with a scan.
+   */
+  template <typename Endpoint>
+  void
+  _point_loop(const char* name) {
+    typedef DS::interval_tree<int, int, std::less<int>,
+                              std::allocator<std::pair<
+                                const std::pair<const int,const int>,
+                                DS::interval_tree_value<int,int> > >,
+                              Endpoint> Tree;
+    std::mt19937 rng(26);
+    std::uniform_int_distribution<int> low(0, 999), length(0, 30);
+    Tree t;
+    std::vector<Span> spans;
+    for (int i = 0; i < 500; ++i) {
+      int l = low(rng);
+      Span s(l, l + length(rng));
+      if (t.insert(typename Tree::value_type(
+            typename Tree::interval_type(s.first, s.second), i)).second)
+        spans.push_back(s);
+    }
+    const Tree& c = t;
+    for (int k = -5; k < 1040; ++k) {
+      std::size_t expected = 0;
+      for (std::size_t j = 0; j < spans.size(); ++j)
+        expected += _contains<Endpoint>(spans[j], k);
+      std::size_t found = 0, found_const = 0;
+      for (typename Tree::point_const_iterator i = t.equal_range(k);
+           i != t.end(); ++i)
+        ++found;
+      for (typename Tree::point_const_iterator i = c.equal_range(k);
+           !(c.end() == i); ++i)
+        ++found_const;
+      _check(found == expected, name, k);
+      _check(found_const == expected, name, k);
+    }
+  }
+}
+
+int
+main() {
+  _point_loop<DS::Interval::open>("open");
+  _point_loop<DS::Interval::closed>("closed");
+  _point_loop<DS::Interval::right_open>("right_open");
+  _point_loop<DS::Interval::left_open>("left_open");
+  return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,101 @@
+/******************************************************************************
+ *                                 Test
+ *        Random splits and joins compared with std::map, with and
+ *                        without subtree sizes.
+ *
+ * Exits with a non zero status, after printing the failed check, when a
+ * piece is unbalanced, miscounted or holds other keys than the map.
+ *****************************************************************************/
+
+#include <cstdlib>
+#include <map>
+#include <random>
+
+#include "checked_tree.hpp"
+
+namespace {
+
+  /**
+   * Fill t and m with n random keys from [0,range).
+   */
+  template <typename Tree>
+  void
+  _fill(Tree& t, std::map<int,int>& m, int n, int range, std::mt19937& rng) {
+    std::uniform_int_distribution<int> key(0, range - 1);
+    for (int i = 0; i < n; ++i) {
+      int k = key(rng);
+      t.insert(typename Tree::value_type(k, i));
+      m.insert(std::make_pair(k, i));
+    }
+  }
+
+  /**
+   * Split random trees at random keys, in or out of the tree and past
+   * either end, check both pieces, then join them back and check again.
+   */
+  template <typename Sizes>
+  void
+  _split_join(const char* name) {
+    typedef test::checked_tree<int, int, Sizes> Tree;
+    std::mt19937 rng(41);
+    std::uniform_int_distribution<int> size(0, 3000);
+    for (int round = 0; round < 200; ++round) {
+      const int range = 4000;
+      Tree t, right;
+      std::map<int,int> m;
+      _fill(t, m, size(rng), range, rng);
+      int k = std::uniform_int_distribution<int>(-10, range + 10)(rng);
+      if (round % 5 == 0 && !m.empty())
+        k = round % 10 == 0 ? m.begin()->first : m.rbegin()->first;
+      std::map<int,int> high(m.lower_bound(k), m.end());
+      m.erase(m.lower_bound(k), m.end());
+
+      t.split(k, right);
+      test::check(t.valid() && t.same(m), name, round);
+      test::check(right.valid() && right.same(high), name, round);
+
+      t.join(right);
+      m.insert(high.begin(), high.end());
+      test::check(t.valid() && t.same(m) && right.empty(), name, round);
+    }
+  }
+
+  /**
+   * Join trees of very different heights on either side, then split the
+   * result back at the seam.
+   */
+  template <typename Sizes>
+  void
+  _uneven_join(const char* name) {
+    typedef test::checked_tree<int, int, Sizes> Tree;
+    std::mt19937 rng(42);
+    std::uniform_int_distribution<int> size(0, 2000);
+    for (int round = 0; round < 200; ++round) {
+      Tree l, r;
+      std::map<int,int> ml, mr;
+      int nl = size(rng), nr = round % 2 == 0 ? nl / 50 : nl * 3;
+      _fill(l, ml, nl, 10000, rng);
+      for (int i = 0; i < nr; ++i) {
+        r.insert(typename Tree::value_type(10000 + i, i));
+        mr.insert(std::make_pair(10000 + i, i));
+      }
+      l.join(r);
+      std::map<int,int> m(ml);
+      m.insert(mr.begin(), mr.end());
+      test::check(l.valid() && l.same(m) && r.empty(), name, round);
+
+      l.split(10000, r);
+      test::check(l.valid() && l.same(ml), name, round);
+      test::check(r.valid() && r.same(mr), name, round);
+    }
+  }
+}
+
+int
+main() {
+  _split_join<DS::AVL::unsized>("split_join unsized");
+  _split_join<DS::AVL::sized>("split_join sized");
+  _uneven_join<DS::AVL::unsized>("uneven_join unsized");
+  _uneven_join<DS::AVL::sized>("uneven_join sized");
+  return test::failures() == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}